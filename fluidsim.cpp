@@ -8,6 +8,10 @@
 float fraction_inside(float phi_left, float phi_right);
 void extrapolate(Array2f& grid, Array2c& valid);
 
+//Velocity face states for the viscosity solve
+const char SOLID = 1;
+const char FLUID = 0;
+
 float circle_phi(const Vec2f& pos) {
    Vec2f centre(0.5f,0.75f);
    float rad = 0.1f;
@@ -35,6 +39,19 @@ void FluidSim::initialize(float width, int ni_, int nj_) {
    particle_radius = dx/sqrt(2.0f);
    viscosity.resize(ni,nj);
    viscosity.assign(1.0f);
+   viscosity_structure_valid = false;
+   pressure_preconditioner = PRESSURE_PRECONDITIONER_MIC0;
+   matrix_free_pressure = false;
+   warm_start_solves = true;
+   mixed_precision_solves = false;
+   single_reduction_solves = false;
+   solve_matrix_format = MATRIX_FORMAT_CSR;
+   parallel_assembly = true;
+   preconditioner_reuse = 0;
+   viscosity_preconditioner = VISCOSITY_PRECONDITIONER_MIC0;
+   viscosity_ordering = VISCOSITY_ORDERING_SEPARATE;
+   record_residual_history = false;
+   substep_count = 0;
    //surface.reset_phi(circle_phi, dx, Vec2f(0.5*dx,0.5*dx), ni, nj);
 }
 
@@ -45,15 +62,16 @@ void FluidSim::set_boundary(float (*phi)(const Vec2f&)) {
       Vec2f pos(i*dx,j*dx);
       nodal_solid_phi(i,j) = phi(pos);
    }
+   viscosity_structure_valid = false;
 
 }
 
 float FluidSim::cfl() {
    float maxvel = 0;
    for(unsigned int i = 0; i < u.a.size(); ++i)
-      maxvel = max(maxvel, fabs(u.a[i]));
+      maxvel = max(maxvel, (float)fabs(u.a[i]));
    for(unsigned int i = 0; i < v.a.size(); ++i)
-      maxvel = max(maxvel, fabs(v.a[i]));
+      maxvel = max(maxvel, (float)fabs(v.a[i]));
    return dx / maxvel;
 }
 
@@ -67,30 +85,55 @@ void FluidSim::advance(float dt) {
          substep = dt - t;
    
       //Passively advect particles
-      advect_particles(substep);
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_ADVECT_PARTICLES);
+         advect_particles(substep);
+      }
      
       //Estimate the liquid signed distance
-      compute_phi();
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_COMPUTE_PHI);
+         compute_phi();
+      }
 
       //Advance the velocity
-      advect(substep);
-      add_force(substep);
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_ADVECT);
+         advect(substep);
+      }
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_ADD_FORCE);
+         add_force(substep);
+      }
 
-      apply_viscosity(substep);
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_APPLY_VISCOSITY);
+         apply_viscosity(substep);
+      }
 
-      apply_projection(substep); 
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_APPLY_PROJECTION);
+         apply_projection(substep); 
+      }
       
       //Pressure projection only produces valid velocities in faces with non-zero associated face area.
       //Because the advection step may interpolate from these invalid faces, 
       //we must extrapolate velocities from the fluid domain into these zero-area faces.
-      extrapolate(u, u_valid);
-      extrapolate(v, v_valid);
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_EXTRAPOLATE);
+         extrapolate(u, u_valid);
+         extrapolate(v, v_valid);
+      }
 
       //For extrapolated velocities, replace the normal component with
       //that of the object.
-      constrain_velocity();
+      {
+         FLUIDSIM_TIME_STAGE(timers, STAGE_CONSTRAIN_VELOCITY);
+         constrain_velocity();
+      }
    
       t+=substep;
+      ++substep_count;
    }
 }
 
@@ -257,11 +300,9 @@ void FluidSim::apply_projection(float dt) {
 
 void FluidSim::apply_viscosity(float dt) {
    
-   printf("Computing weights\n");
    //Estimate weights at velocity and stress positions
    compute_viscosity_weights();
 
-   printf("Setting up solve\n");
    //Set up and solve the linear system
    solve_viscosity(dt);
 
@@ -349,28 +390,24 @@ void FluidSim::compute_viscosity_weights() {
 
 }
 
-//An implementation of the variational pressure projection solve for static geometry
-void FluidSim::solve_pressure(float dt) {
-   
-   //This linear system could be simplified, but I've left it as is for clarity 
-   //and consistency with the standard naive discretization
-   
+//Assemble the variational pressure system into target (a SparseMatrixBuilder or
+//a StructuredGridMatrix - anything with add_to_element), and add into rhs.
+//Rows and columns are the unknowns given by pressure_index; couplings to cells
+//without one (the outer ring) are dropped. Each cell writes only its own row
+//(and rhs entry), so the grid rows are filled in parallel.
+template<class MatrixT>
+void FluidSim::build_pressure_system(MatrixT& target, float dt) {
+
    int ni = v.ni;
    int nj = u.nj;
-   int system_size = ni*nj;
-   if(rhs.size() != system_size) {
-      rhs.resize(system_size);
-      pressure.resize(system_size);
-      matrix.resize(system_size);
-   }
-   matrix.zero();
-   
+
    //Build the linear system for pressure
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(parallel_assembly)
+#endif
    for(int j = 1; j < nj-1; ++j) {
       for(int i = 1; i < ni-1; ++i) {
-         int index = i + ni*j;
-         rhs[index] = 0;
-         pressure[index] = 0;
+         int index = pressure_index(i,j);
          float centre_phi = liquid_phi(i,j);
          if(centre_phi < 0) {
 
@@ -378,13 +415,14 @@ void FluidSim::solve_pressure(float dt) {
             float term = u_weights(i+1,j) * dt / sqr(dx);
             float right_phi = liquid_phi(i+1,j);
             if(right_phi < 0) {
-               matrix.add_to_element(index, index, term);
-               matrix.add_to_element(index, index + 1, -term);
+               target.add_to_element(index, index, term);
+               if(pressure_index(i+1,j) >= 0)
+                  target.add_to_element(index, pressure_index(i+1,j), -term);
             }
             else {
                float theta = fraction_inside(centre_phi, right_phi);
                if(theta < 0.01f) theta = 0.01f;
-               matrix.add_to_element(index, index, term/theta);
+               target.add_to_element(index, index, term/theta);
             }
             rhs[index] -= u_weights(i+1,j)*u(i+1,j) / dx;
             
@@ -392,13 +430,14 @@ void FluidSim::solve_pressure(float dt) {
             term = u_weights(i,j) * dt / sqr(dx);
             float left_phi = liquid_phi(i-1,j);
             if(left_phi < 0) {
-               matrix.add_to_element(index, index, term);
-               matrix.add_to_element(index, index - 1, -term);
+               target.add_to_element(index, index, term);
+               if(pressure_index(i-1,j) >= 0)
+                  target.add_to_element(index, pressure_index(i-1,j), -term);
             }
             else {
                float theta = fraction_inside(centre_phi, left_phi);
                if(theta < 0.01f) theta = 0.01f;
-               matrix.add_to_element(index, index, term/theta);
+               target.add_to_element(index, index, term/theta);
             }
             rhs[index] += u_weights(i,j)*u(i,j) / dx;
             
@@ -406,13 +445,14 @@ void FluidSim::solve_pressure(float dt) {
             term = v_weights(i,j+1) * dt / sqr(dx);
             float top_phi = liquid_phi(i,j+1);
             if(top_phi < 0) {
-               matrix.add_to_element(index, index, term);
-               matrix.add_to_element(index, index + ni, -term);
+               target.add_to_element(index, index, term);
+               if(pressure_index(i,j+1) >= 0)
+                  target.add_to_element(index, pressure_index(i,j+1), -term);
             }
             else {
                float theta = fraction_inside(centre_phi, top_phi);
                if(theta < 0.01f) theta = 0.01f;
-               matrix.add_to_element(index, index, term/theta);
+               target.add_to_element(index, index, term/theta);
             }
             rhs[index] -= v_weights(i,j+1)*v(i,j+1) / dx;
             
@@ -420,38 +460,156 @@ void FluidSim::solve_pressure(float dt) {
             term = v_weights(i,j) * dt / sqr(dx);
             float bot_phi = liquid_phi(i,j-1);
             if(bot_phi < 0) {
-               matrix.add_to_element(index, index, term);
-               matrix.add_to_element(index, index - ni, -term);
+               target.add_to_element(index, index, term);
+               if(pressure_index(i,j-1) >= 0)
+                  target.add_to_element(index, pressure_index(i,j-1), -term);
             }
             else {
                float theta = fraction_inside(centre_phi, bot_phi);
                if(theta < 0.01f) theta = 0.01f;
-               matrix.add_to_element(index, index, term/theta);
+               target.add_to_element(index, index, term/theta);
             }
             rhs[index] += v_weights(i,j)*v(i,j) / dx;
          }
       }
    }
+}
+
+//Number the unknowns of the pressure system. The sparse system only has the
+//liquid cells, so its size and the PCG vector work scale with the fluid volume
+//rather than the domain; the matrix-free stencil needs the whole grid.
+//Returns whether the numbering (and so the matrix structure) changed.
+bool FluidSim::number_pressure_unknowns() {
+   
+   int ni = v.ni;
+   int nj = u.nj;
+   std::vector<int> previous_cell;
+   previous_cell.swap(pressure_cell);
+   pressure_index.resize(ni, nj);
+   pressure_index.assign(-1);
+   for(int j = 0; j < nj; ++j) for(int i = 0; i < ni; ++i) {
+      //the outer ring of cells never enters the system (see build_pressure_system)
+      bool interior = i > 0 && i < ni-1 && j > 0 && j < nj-1;
+      if(matrix_free_pressure || (interior && liquid_phi(i,j) < 0)) {
+         pressure_index(i,j) = (int)pressure_cell.size();
+         pressure_cell.push_back(i + ni*j);
+      }
+   }
+   return pressure_cell != previous_cell;
+}
+
+//An implementation of the variational pressure projection solve for static geometry
+void FluidSim::solve_pressure(float dt) {
+   
+   //This linear system could be simplified, but I've left it as is for clarity 
+   //and consistency with the standard naive discretization
+   
+   int ni = v.ni;
+   int nj = u.nj;
+   bool rebuild_structure = number_pressure_unknowns();
+   int system_size = (int)pressure_cell.size();
+   rhs.assign(system_size, 0);
+   pressure.resize(system_size);
+   if(!matrix_free_pressure && matrix_builder.n != (unsigned int)system_size)
+      matrix_builder.resize(system_size, 5);
+   if(pressure_grid.ni != ni || pressure_grid.nj != nj) {
+      pressure_grid.resize(ni, nj);
+      pressure_grid.set_zero();
+   }
 
-   //Solve the system using Robert Bridson's incomplete Cholesky PCG solver
+   //Liquid cells start from the previous pressure; everywhere else the pressure
+   //must be zero (free surface)
+   for(int index = 0; index < system_size; ++index) {
+      int cell = pressure_cell[index];
+      pressure[index] = (warm_start_solves && liquid_phi.a[cell] < 0) ? pressure_grid.a[cell] : 0;
+   }
    
+   //Build the linear system for pressure, either as a general sparse matrix or
+   //as a matrix-free 5-point stencil
+   {
+      FLUIDSIM_TIME_STAGE(timers, STAGE_ASSEMBLE_PRESSURE);
+      if(matrix_free_pressure) {
+         if(grid_matrix.ni != ni || grid_matrix.nj != nj)
+            grid_matrix.resize(ni, nj);
+         grid_matrix.zero();
+         build_pressure_system(grid_matrix, dt);
+      }
+      else {
+         matrix_builder.zero();
+         build_pressure_system(matrix_builder, dt);
+         //the same unknowns give the same sequence of builder entries, so the
+         //structure (and with it any MIC(0) symbolic data) can be kept
+         if(rebuild_structure || matrix.n != (unsigned int)system_size)
+            matrix.construct_from_builder(matrix_builder);
+         else
+            matrix.update_from_builder(matrix_builder);
+      }
+   }
+
+   //Solve the system using Robert Bridson's incomplete Cholesky PCG solver,
+   //or with a multigrid preconditioner that respects the same stencil
+   solver.set_single_reduction(single_reduction_solves);
+   solver.set_matrix_format(solve_matrix_format);
+   solver.set_preconditioner_reuse(preconditioner_reuse);
+   solver.set_residual_history(record_residual_history);
    double tolerance;
    int iterations;
-   bool success = solver.solve(matrix, rhs, pressure, tolerance, iterations);
+   bool success;
+   if(matrix_free_pressure) {
+      //the matrix-free preconditioners are formed here rather than by the solver
+      std::chrono::steady_clock::time_point form_start = std::chrono::steady_clock::now();
+      if(pressure_preconditioner == PRESSURE_PRECONDITIONER_MULTIGRID) {
+         pressure_multigrid.form(grid_matrix);
+         solver.set_preconditioner(&pressure_multigrid);
+      }
+      else if(pressure_preconditioner == PRESSURE_PRECONDITIONER_CHEBYSHEV) {
+         pressure_chebyshev.form(grid_matrix);
+         solver.set_preconditioner(&pressure_chebyshev);
+      }
+      else {
+         pressure_grid_mic0.form(grid_matrix);
+         solver.set_preconditioner(&pressure_grid_mic0);
+      }
+      double form_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - form_start).count();
+      success = solver.solve_operator(grid_matrix, rhs, pressure, tolerance, iterations, warm_start_solves);
+      PCGSolveStats stats = solver.get_last_solve_stats();
+      stats.nonzeros = grid_matrix.nonzeros();
+      stats.factor_seconds = form_seconds;
+      telemetry.record(substep_count, SOLVE_PRESSURE, stats);
+   }
+   else {
+      if(pressure_preconditioner == PRESSURE_PRECONDITIONER_MULTIGRID) {
+         pressure_multigrid.set_grid(ni, nj, pressure_cell);
+         solver.set_preconditioner(&pressure_multigrid);
+      }
+      else if(pressure_preconditioner == PRESSURE_PRECONDITIONER_SCHWARZ)
+         solver.set_preconditioner(&pressure_schwarz);
+      else if(pressure_preconditioner == PRESSURE_PRECONDITIONER_CHEBYSHEV)
+         solver.set_preconditioner(&pressure_chebyshev);
+      else
+         solver.set_preconditioner(0);
+      solver.set_mixed_precision(mixed_precision_solves);
+      success = solver.solve(matrix, rhs, pressure, tolerance, iterations, warm_start_solves);
+      telemetry.record(substep_count, SOLVE_PRESSURE, solver.get_last_solve_stats());
+   }
    if(!success) {
       printf("WARNING: Pressure solve failed!************************************************\n");
    }
+
+   //Scatter the solution back to the grid
+   pressure_grid.set_zero();
+   for(int index = 0; index < system_size; ++index)
+      pressure_grid.a[pressure_cell[index]] = pressure[index];
    
    //Apply the velocity update
    u_valid.assign(0);
    for(int j = 0; j < u.nj; ++j) for(int i = 1; i < u.ni-1; ++i) {
-      int index = i + j*ni;
       if(u_weights(i,j) > 0 && (liquid_phi(i,j) < 0 || liquid_phi(i-1,j) < 0)) {
          float theta = 1;
          if(liquid_phi(i,j) >= 0 || liquid_phi(i-1,j) >= 0)
             theta = fraction_inside(liquid_phi(i-1,j), liquid_phi(i,j));
          if(theta < 0.01f) theta = 0.01f;
-         u(i,j) -= dt  * (float)(pressure[index] - pressure[index-1]) / dx / theta; 
+         u(i,j) -= dt  * (float)(pressure_grid(i,j) - pressure_grid(i-1,j)) / dx / theta; 
          u_valid(i,j) = 1;
       }
       else
@@ -459,13 +617,12 @@ void FluidSim::solve_pressure(float dt) {
    }
    v_valid.assign(0);
    for(int j = 1; j < v.nj-1; ++j) for(int i = 0; i < v.ni; ++i) {
-      int index = i + j*ni;
       if(v_weights(i,j) > 0 && (liquid_phi(i,j) < 0 || liquid_phi(i,j-1) < 0)) {
          float theta = 1;
          if(liquid_phi(i,j) >= 0 || liquid_phi(i,j-1) >= 0)
             theta = fraction_inside(liquid_phi(i,j-1), liquid_phi(i,j));
          if(theta < 0.01f) theta = 0.01f;
-         v(i,j) -= dt  * (float)(pressure[index] - pressure[index-ni]) / dx / theta; 
+         v(i,j) -= dt  * (float)(pressure_grid(i,j) - pressure_grid(i,j-1)) / dx / theta; 
          v_valid(i,j) = 1;
       }
       else
@@ -483,22 +640,15 @@ int FluidSim::v_ind(int i, int j) {
 }
 
 
-void FluidSim::solve_viscosity(float dt) {
-   int ni = liquid_phi.ni;
-   int nj = liquid_phi.nj;
-   
-   //static obstacles for simplicity - for moving objects, 
-   //use a spatially varying 2d array, and modify the linear system appropriately
-   float u_obj = 0;
-   float v_obj = 0;
-
-   Array2c u_state(ni+1,nj,(const char&)0);
-   Array2c v_state(ni,nj+1,(const char&)0);
-   const int SOLID = 1;
-   const int FLUID = 0;
+//Classify velocity faces for the viscosity solve:
+//just determine if the face position is inside the wall! That's it.
+void FluidSim::compute_viscosity_states() {
+   u_state.resize(ni+1,nj);
+   v_state.resize(ni,nj+1);
 
-   printf("Determining states\n");
-   //just determine if the face position is inside the wall! That's it.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(parallel_assembly)
+#endif
    for(int j = 0; j < nj; ++j) {
       for(int i = 0; i < ni+1; ++i) {
          if(i - 1 < 0 || i >= ni || (nodal_solid_phi(i,j+1) + nodal_solid_phi(i,j))/2 <= 0)
@@ -509,6 +659,9 @@ void FluidSim::solve_viscosity(float dt) {
    }
 
 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(parallel_assembly)
+#endif
    for(int j = 0; j < nj+1; ++j)  {
       for(int i = 0; i < ni; ++i) {
          if(j - 1 < 0 || j >= nj || (nodal_solid_phi(i+1,j) + nodal_solid_phi(i,j))/2 <= 0)
@@ -517,175 +670,275 @@ void FluidSim::solve_viscosity(float dt) {
             v_state(i,j) = FLUID;
       }
    }
-   
-   printf("Building matrix\n");
-   int elts = (ni+1)*nj + ni*(nj+1);
-   if(vrhs.size() != elts) {
-      vrhs.resize(elts);
-      velocities.resize(elts);
-      vmatrix.resize(elts);
+}
+
+//Whether a face gets an unknown in the viscosity system: the FLUID faces inside
+//the assembly loops that touch some liquid, in their own control volume or in
+//the cell and node volumes their stencil uses. Any other face has an all-zero
+//row and column, so it is left out (and its velocity is zero after the solve).
+bool FluidSim::has_u_unknown(int i, int j) {
+   return u_state(i,j) == FLUID && (u_vol(i,j) > 0 || c_vol(i,j) > 0 || c_vol(i-1,j) > 0 || n_vol(i,j+1) > 0 || n_vol(i,j) > 0);
+}
+
+bool FluidSim::has_v_unknown(int i, int j) {
+   return v_state(i,j) == FLUID && (v_vol(i,j) > 0 || c_vol(i,j) > 0 || c_vol(i,j-1) > 0 || n_vol(i+1,j) > 0 || n_vol(i,j) > 0);
+}
+
+//Number the u and then the v face of cell (i,j), 1 <= i < ni-1, 1 <= j < nj
+void FluidSim::number_viscosity_cell(int i, int j) {
+   if(j < liquid_phi.nj-1 && has_u_unknown(i,j)) {
+      u_index(i,j) = (int)velocity_face.size();
+      velocity_face.push_back(u_ind(i,j));
    }
-   vmatrix.zero();
+   if(has_v_unknown(i,j)) {
+      v_index(i,j) = (int)velocity_face.size();
+      velocity_face.push_back(v_ind(i,j));
+   }
+}
+
+//The even bits of code, packed together
+static inline unsigned int morton_compact(unsigned int code) {
+   code &= 0x55555555u;
+   code = (code | (code >> 1)) & 0x33333333u;
+   code = (code | (code >> 2)) & 0x0f0f0f0fu;
+   code = (code | (code >> 4)) & 0x00ff00ffu;
+   code = (code | (code >> 8)) & 0x0000ffffu;
+   return code;
+}
+
+//Number the unknowns of the viscosity system in viscosity_ordering.
+//Returns whether the numbering differs from the previous call.
+bool FluidSim::number_viscosity_unknowns() {
+   int ni = liquid_phi.ni;
+   int nj = liquid_phi.nj;
    
-   float factor = dt/sqr(dx);
-   for(int j = 1; j < nj-1; ++j) for(int i = 1; i < ni-1; ++i) {
-      if(u_state(i,j) == FLUID ) {
-         int index = u_ind(i,j);      
-         
-         vrhs[index] = u_vol(i,j) * u(i,j);
-         vmatrix.set_element(index,index,u_vol(i,j));
-         
-         //uxx terms
-         float visc_right = viscosity(i,j);
-         float visc_left = viscosity(i-1,j);
-         float vol_right = c_vol(i,j);
-         float vol_left = c_vol(i-1,j);
-
-        //u_x_right
-         vmatrix.add_to_element(index,index, 2*factor*visc_right*vol_right);
-         if(u_state(i+1,j) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i+1,j), -2*factor*visc_right*vol_right);
-         else if(u_state(i+1,j) == SOLID)
-            vrhs[index] -= -2*factor*visc_right*vol_right*u_obj;
-
-         //u_x_left
-         vmatrix.add_to_element(index,index, 2*factor*visc_left*vol_left);
-         if(u_state(i-1,j) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i-1,j), -2*factor*visc_left*vol_left);
-         else if(u_state(i-1,j) == SOLID)
-            vrhs[index] -= -2*factor*visc_left*vol_left*u_obj;
-         
-         //uyy terms
-         float visc_top = 0.25f*(viscosity(i-1,j+1) + viscosity(i-1,j) + viscosity(i,j+1) + viscosity(i,j));
-         float visc_bottom = 0.25f*(viscosity(i-1,j) + viscosity(i-1,j-1) + viscosity(i,j) + viscosity(i,j-1));
-         float vol_top = n_vol(i,j+1);
-         float vol_bottom = n_vol(i,j);
-
-         //u_y_top
-         vmatrix.add_to_element(index,index, +factor*visc_top*vol_top);
-         if(u_state(i,j+1) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i,j+1), -factor*visc_top*vol_top);
-         else if(u_state(i,j+1) == SOLID)
-            vrhs[index] -= -u_obj*factor*visc_top*vol_top;
-      
-         //u_y_bottom
-         vmatrix.add_to_element(index,index, +factor*visc_bottom*vol_bottom);
-         if(u_state(i,j-1) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i,j-1), -factor*visc_bottom*vol_bottom);
-         else if(u_state(i,j-1) == SOLID)
-            vrhs[index] -= -u_obj*factor*visc_bottom*vol_bottom;
-      
-         //vxy terms
-         //v_x_top
-         if(v_state(i,j+1) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i,j+1), -factor*visc_top*vol_top);
-         else if(v_state(i,j+1) == SOLID)
-            vrhs[index] -= -v_obj*factor*visc_top*vol_top;
-         
-         if(v_state(i-1,j+1) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i-1,j+1), factor*visc_top*vol_top);
-         else if(v_state(i-1,j+1) == SOLID)
-            vrhs[index] -= v_obj*factor*visc_top*vol_top;
-     
-         //v_x_bottom
-         if(v_state(i,j) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i,j), +factor*visc_bottom*vol_bottom);
-         else if(v_state(i,j) == SOLID)
-            vrhs[index] -= v_obj*factor*visc_bottom*vol_bottom;
-         
-         if(v_state(i-1,j) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i-1,j), -factor*visc_bottom*vol_bottom);
-         else if(v_state(i-1,j) == SOLID)
-            vrhs[index] -= -v_obj*factor*visc_bottom*vol_bottom;
-      
+   std::vector<int> previous_face;
+   previous_face.swap(velocity_face);
+   velocity_face.reserve(previous_face.size());
+   u_index.resize(ni+1, nj);
+   v_index.resize(ni, nj+1);
+   u_index.assign(-1);
+   v_index.assign(-1);
+
+   if(viscosity_ordering == VISCOSITY_ORDERING_INTERLEAVED) {
+      for(int j = 1; j < nj; ++j) for(int i = 1; i < ni-1; ++i)
+         number_viscosity_cell(i,j);
+   }
+   else if(viscosity_ordering == VISCOSITY_ORDERING_MORTON) {
+      //walk the Z-curve over the smallest power-of-two square covering the
+      //grid, skipping the cells outside the assembly loops
+      unsigned int side = 1;
+      while(side < (unsigned int)ni || side < (unsigned int)nj)
+         side *= 2;
+      for(unsigned int code = 0; code < side*side; ++code) {
+         int i = (int)morton_compact(code), j = (int)morton_compact(code >> 1);
+         if(i >= 1 && i < ni-1 && j >= 1 && j < nj)
+            number_viscosity_cell(i,j);
+      }
+   }
+   else {
+      for(int j = 1; j < nj-1; ++j) for(int i = 1; i < ni-1; ++i)
+         if(has_u_unknown(i,j)) {
+            u_index(i,j) = (int)velocity_face.size();
+            velocity_face.push_back(u_ind(i,j));
+         }
+      for(int j = 1; j < nj; ++j) for(int i = 1; i < ni-1; ++i)
+         if(has_v_unknown(i,j)) {
+            v_index(i,j) = (int)velocity_face.size();
+            velocity_face.push_back(v_ind(i,j));
+         }
+   }
+   return velocity_face != previous_face;
+}
+
+//Weight of flux F of the stencil at face (i,j): scale*dt/dx^2 times the
+//viscosity and the volume fraction sampled at that side
+template<class Stencil, int F>
+void FluidSim::viscous_flux_weights(int i, int j, float factor, float* weight, std::true_type) {
+   constexpr ViscousFlux side = Stencil::flux(F);
+   float visc = viscosity(i+side.ci[0], j+side.cj[0]);
+   if(side.cells == 4)
+      visc = 0.25f*(visc + viscosity(i+side.ci[1], j+side.cj[1]) + viscosity(i+side.ci[2], j+side.cj[2])
+                    + viscosity(i+side.ci[3], j+side.cj[3]));
+   float vol = side.sample == STENCIL_CELL ? c_vol(i+side.si, j+side.sj) : n_vol(i+side.si, j+side.sj);
+   weight[F] = side.scale*factor*visc*vol;
+   viscous_flux_weights<Stencil, F+1>(i, j, factor, weight, std::integral_constant<bool, (F+1 < Stencil::FLUXES)>());
+}
 
+template<class Stencil, int F>
+void FluidSim::viscous_flux_weights(int, int, float, float*, std::false_type) {}
+
+//Term T of the stencil for the row of face (i,j). Couplings to FLUID faces
+//outside the system (index -1) are dropped; SOLID faces move their known
+//velocity to the right-hand side, and AIR faces contribute nothing.
+template<class Stencil, int T>
+void FluidSim::add_viscous_terms(int index, int i, int j, const float* weight, std::true_type) {
+   //static obstacles, as in solve_viscosity
+   const float u_obj = 0;
+   const float v_obj = 0;
+
+   constexpr ViscousTerm entry = Stencil::term(T);
+   float value = entry.sign*weight[entry.flux];
+   if(entry.face == Stencil::FACE && entry.di == 0 && entry.dj == 0)
+      vmatrix_builder.add_to_element(index, index, value);
+   else if(entry.face == STENCIL_U_FACE) {
+      if(u_state(i+entry.di, j+entry.dj) == FLUID) {
+         int col = u_index(i+entry.di, j+entry.dj);
+         if(col >= 0)
+            vmatrix_builder.add_to_element(index, col, value);
+      }
+      else if(u_state(i+entry.di, j+entry.dj) == SOLID)
+         vrhs[index] -= value*u_obj;
+   }
+   else {
+      if(v_state(i+entry.di, j+entry.dj) == FLUID) {
+         int col = v_index(i+entry.di, j+entry.dj);
+         if(col >= 0)
+            vmatrix_builder.add_to_element(index, col, value);
       }
+      else if(v_state(i+entry.di, j+entry.dj) == SOLID)
+         vrhs[index] -= value*v_obj;
    }
+   add_viscous_terms<Stencil, T+1>(index, i, j, weight, std::integral_constant<bool, (T+1 < Stencil::TERMS)>());
+}
+
+template<class Stencil, int T>
+void FluidSim::add_viscous_terms(int, int, int, const float*, std::false_type) {}
+
+//Add one row of the viscosity system: the mass term of the row's own face
+//and the stress terms of the stencil (see viscousstencil.h)
+template<class Stencil>
+void FluidSim::add_viscous_row(int index, int i, int j, float volume, float velocity, float factor) {
+   vrhs[index] = volume * velocity;
+   vmatrix_builder.set_element(index, index, volume);
+   float weight[Stencil::FLUXES];
+   viscous_flux_weights<Stencil, 0>(i, j, factor, weight, std::true_type());
+   add_viscous_terms<Stencil, 0>(index, i, j, weight, std::true_type());
+}
+
+//Build the viscosity system over the numbered faces into vmatrix and vrhs.
+//Each face writes only its own row and rhs entry, and 9 slots hold every
+//row, so the rows are filled in parallel (see SparseMatrixBuilder).
+void FluidSim::build_viscosity_system(float dt, bool rebuild_structure) {
+   int ni = liquid_phi.ni;
+   int nj = liquid_phi.nj;
+   int elts = (int)velocity_face.size();
+
+   if(rebuild_structure)
+      vmatrix_builder.resize(elts, 9);
+   vmatrix_builder.zero();
    
+   float factor = dt/sqr(dx);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(parallel_assembly)
+#endif
+   for(int j = 1; j < nj-1; ++j) for(int i = 1; i < ni-1; ++i) {
+      int index = u_index(i,j);
+      if(index >= 0)
+         add_viscous_row<URowStencil>(index, i, j, u_vol(i,j), u(i,j), factor);
+   }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(parallel_assembly)
+#endif
    for(int j = 1; j < nj; ++j) for(int i = 1; i < ni-1; ++i) {
-      if(v_state(i,j) == FLUID) {
-         int index = v_ind(i,j);      
-         
-         vrhs[index] = v_vol(i,j)*v(i,j);
-         vmatrix.set_element(index, index, v_vol(i,j));
-
-         //vyy
-         float visc_top = viscosity(i,j);
-         float visc_bottom = viscosity(i,j-1);
-         float vol_top = c_vol(i,j);
-         float vol_bottom = c_vol(i,j-1);
-
-         //vy_top
-         vmatrix.add_to_element(index,index, +2*factor*visc_top*vol_top);
-         if(v_state(i,j+1) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i,j+1), -2*factor*visc_top*vol_top);
-         else if (v_state(i,j+1) == SOLID)
-            vrhs[index] -= -2*factor*visc_top*vol_top*v_obj;
-         
-         //vy_bottom
-         vmatrix.add_to_element(index,index, +2*factor*visc_bottom*vol_bottom);
-         if(v_state(i,j-1) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i,j-1), -2*factor*visc_bottom*vol_bottom);
-         else if(v_state(i,j-1) == SOLID)
-            vrhs[index] -= -2*factor*visc_bottom*vol_bottom*v_obj;
-         
-         //vxx terms
-         float visc_right = 0.25f*(viscosity(i,j-1) + viscosity(i+1,j-1) + viscosity(i,j) + viscosity(i+1,j));
-         float visc_left = 0.25f*(viscosity(i,j-1) + viscosity(i-1,j-1) + viscosity(i,j) + viscosity(i-1,j));
-         float vol_right = n_vol(i+1,j);
-         float vol_left = n_vol(i,j);
-
-         //v_x_right
-         vmatrix.add_to_element(index,index, +factor*visc_right*vol_right);
-         if(v_state(i+1,j) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i+1,j), -factor*visc_right*vol_right);
-         else if(v_state(i+1,j) == SOLID)
-            vrhs[index] -= -v_obj*factor*visc_right*vol_right;
-      
-         //v_x_left
-         vmatrix.add_to_element(index,index, +factor*visc_left*vol_left);
-         if(v_state(i-1,j) == FLUID)
-            vmatrix.add_to_element(index,v_ind(i-1,j), -factor*visc_left*vol_left);
-         else if(v_state(i-1,j) == SOLID)
-            vrhs[index] -= -v_obj*factor*visc_left*vol_left;
-
-         //uyx
-
-         //u_y_right
-         if(u_state(i+1,j) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i+1,j), -factor*visc_right*vol_right);
-         else if(u_state(i+1,j) == SOLID)
-            vrhs[index] -= -u_obj*factor*visc_right*vol_right;
-         
-         if(u_state(i+1,j-1) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i+1,j-1), factor*visc_right*vol_right);
-         else if(u_state(i+1,j-1) == SOLID)
-            vrhs[index] -= u_obj*factor*visc_right*vol_right;
-      
-         //u_y_left
-         if(u_state(i,j) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i,j), factor*visc_left*vol_left);
-         else if(u_state(i,j) == SOLID)
-            vrhs[index] -= u_obj*factor*visc_left*vol_left;
-          
-         if(u_state(i,j-1) == FLUID)
-            vmatrix.add_to_element(index,u_ind(i,j-1), -factor*visc_left*vol_left);
-         else if(u_state(i,j-1) == SOLID)
-            vrhs[index] -= -u_obj*factor*visc_left*vol_left;
-      
-      }
+      int index = v_index(i,j);
+      if(index >= 0)
+         add_viscous_row<VRowStencil>(index, i, j, v_vol(i,j), v(i,j), factor);
    }
+   if(rebuild_structure)
+      vmatrix.construct_from_builder(vmatrix_builder);
+   else
+      vmatrix.update_from_builder(vmatrix_builder);
+}
 
+void FluidSim::solve_viscosity(float dt) {
+   int ni = liquid_phi.ni;
+   int nj = liquid_phi.nj;
    
+   //static obstacles for simplicity - for moving objects, 
+   //use a spatially varying 2d array, and modify the linear system appropriately
+   float u_obj = 0;
+   float v_obj = 0;
+
+   //The face states depend only on the static geometry, so they are only recomputed
+   //when it changes. The sparsity structure of the viscosity matrix is reused for as
+   //long as the set of unknowns stays the same too.
+   bool rebuild_structure = !viscosity_structure_valid || u_state.ni != ni+1 || u_state.nj != nj;
+   if(rebuild_structure) {
+      FLUIDSIM_TIME_STAGE(timers, STAGE_VISCOSITY_STATES);
+      compute_viscosity_states();
+      viscosity_structure_valid = true;
+   }
+   if(number_viscosity_unknowns())
+      rebuild_structure = true;
+   int elts = (int)velocity_face.size();
+   
+   if(vrhs.size() != elts) {
+      vrhs.resize(elts);
+      velocities.resize(elts);
+   }
+   {
+      FLUIDSIM_TIME_STAGE(timers, STAGE_ASSEMBLE_VISCOSITY);
+      build_viscosity_system(dt, rebuild_structure);
+   }
+
+   //The current face velocities are an excellent initial guess
+   if(warm_start_solves) {
+      for(int j = 0; j < nj; ++j) for(int i = 0; i < ni+1; ++i)
+         if(u_index(i,j) >= 0)
+            velocities[u_index(i,j)] = u(i,j);
+      for(int j = 0; j < nj+1; ++j) for(int i = 0; i < ni; ++i)
+         if(v_index(i,j) >= 0)
+            velocities[v_index(i,j)] = v(i,j);
+   }
+
    double res_out;
    int iter_out;
    
-   solver.solve(vmatrix, vrhs, velocities, res_out, iter_out);
+   //With the direct solver, PCG preconditioned by the complete Cholesky factor
+   //converges in an iteration or two, which also cleans up after any pivots the
+   //factorization had to perturb in nearly singular systems
+   if(viscosity_preconditioner == VISCOSITY_PRECONDITIONER_CHOLESKY)
+      vsolver.set_preconditioner(&vcholesky);
+   else if(viscosity_preconditioner == VISCOSITY_PRECONDITIONER_AMG) {
+      //The rigid body motions are (nearly) free of viscous stress, so the
+      //coarse levels must be able to represent them
+      if(rebuild_structure || rigid_modes.size() != 3*velocity_face.size()) {
+         rigid_modes.resize(3*velocity_face.size());
+         Vec2f centre(0.5f*ni, 0.5f*nj);
+         for(unsigned int k = 0; k < velocity_face.size(); ++k) {
+            int face = velocity_face[k];
+            bool is_u = face < (ni+1)*nj;
+            Vec2f position = is_u ? Vec2f((float)(face%(ni+1)), face/(ni+1) + 0.5f)
+                                  : Vec2f((face-(ni+1)*nj)%ni + 0.5f, (float)((face-(ni+1)*nj)/ni));
+            position -= centre;
+            rigid_modes[3*k] = is_u ? 1 : 0;
+            rigid_modes[3*k+1] = is_u ? 0 : 1;
+            rigid_modes[3*k+2] = is_u ? -position[1] : position[0];
+         }
+         viscosity_amg.set_near_nullspace(rigid_modes, 3);
+      }
+      vsolver.set_preconditioner(&viscosity_amg);
+   }
+   else if(viscosity_preconditioner == VISCOSITY_PRECONDITIONER_SCHWARZ)
+      vsolver.set_preconditioner(&viscosity_schwarz);
+   else if(viscosity_preconditioner == VISCOSITY_PRECONDITIONER_CHEBYSHEV)
+      vsolver.set_preconditioner(&viscosity_chebyshev);
+   else
+      vsolver.set_preconditioner(0);
+   vsolver.set_mixed_precision(mixed_precision_solves);
+   vsolver.set_single_reduction(single_reduction_solves);
+   vsolver.set_matrix_format(solve_matrix_format);
+   vsolver.set_preconditioner_reuse(preconditioner_reuse);
+   vsolver.set_residual_history(record_residual_history);
+   if(!vsolver.solve(vmatrix, vrhs, velocities, res_out, iter_out, warm_start_solves))
+      printf("WARNING: Viscosity solve failed!\n");
+   telemetry.record(substep_count, SOLVE_VISCOSITY, vsolver.get_last_solve_stats());
    
    for(int j = 0; j < nj; ++j)
       for(int i = 0; i < ni+1; ++i)
          if(u_state(i,j) == FLUID)
-            u(i,j) = (float)velocities[u_ind(i,j)];
+            u(i,j) = u_index(i,j) >= 0 ? (float)velocities[u_index(i,j)] : 0;
          else if(u_state(i,j) == SOLID) 
             u(i,j) = u_obj;
          
@@ -694,7 +947,7 @@ void FluidSim::solve_viscosity(float dt) {
    for(int j = 0; j < nj+1; ++j)
       for(int i = 0; i < ni; ++i)
          if(v_state(i,j) == FLUID)
-            v(i,j) = (float)velocities[v_ind(i,j)];
+            v(i,j) = v_index(i,j) >= 0 ? (float)velocities[v_index(i,j)] : 0;
          else if(v_state(i,j) == SOLID) 
             v(i,j) = v_obj;
 }
@@ -5,9 +5,44 @@
 #include "vec.h"
 #include "pcgsolver/sparse_matrix.h"
 #include "pcgsolver/pcg_solver.h"
-
+#include "pcgsolver/multigrid.h"
+#include "pcgsolver/grid_matrix.h"
+#include "pcgsolver/sparse_cholesky.h"
+#include "pcgsolver/smoothed_aggregation.h"
+#include "pcgsolver/schwarz.h"
+#include "pcgsolver/chebyshev.h"
+#include "stagetimer.h"
+#include "solvertelemetry.h"
+#include "viscousstencil.h"
+
+#include <type_traits>
 #include <vector>
 
+enum PressurePreconditioner {
+   PRESSURE_PRECONDITIONER_MIC0,      //modified incomplete Cholesky, level zero
+   PRESSURE_PRECONDITIONER_MULTIGRID, //geometric multigrid V-cycle
+   PRESSURE_PRECONDITIONER_SCHWARZ,   //MIC(0) per thread subdomain, in parallel (CSR systems only)
+   PRESSURE_PRECONDITIONER_CHEBYSHEV  //Jacobi-scaled Chebyshev polynomial: multiplies only
+};
+
+enum ViscosityPreconditioner {
+   VISCOSITY_PRECONDITIONER_MIC0,      //modified incomplete Cholesky, level zero
+   VISCOSITY_PRECONDITIONER_AMG,       //smoothed aggregation AMG with rigid body modes
+   VISCOSITY_PRECONDITIONER_CHOLESKY,  //complete sparse Cholesky: a direct solve
+   VISCOSITY_PRECONDITIONER_SCHWARZ,   //MIC(0) per thread subdomain, in parallel
+   VISCOSITY_PRECONDITIONER_CHEBYSHEV  //Jacobi-scaled Chebyshev polynomial: multiplies only
+};
+
+//Order of the unknowns of the viscosity system. With all u faces first, a u
+//row's couplings to v faces lie about a grid's worth of unknowns away; keeping
+//the u and v faces of a cell together puts them next to the diagonal, so the
+//multiplies and triangular solves of PCG touch x in a narrow window.
+enum ViscosityOrdering {
+   VISCOSITY_ORDERING_SEPARATE,    //all u faces, then all v faces, each row by row
+   VISCOSITY_ORDERING_INTERLEAVED, //cell by cell, row by row: the u and then the v face of each cell
+   VISCOSITY_ORDERING_MORTON       //the same, with the cells along a Morton (Z-order) curve
+};
+
 class FluidSim {
 
 public:
@@ -34,6 +69,11 @@ public:
    //Data for viscosity solve
    Array2f u_vol, v_vol, c_vol, n_vol;
    Array2f viscosity;
+   Array2c u_state, v_state; //SOLID/FLUID classification of faces, from the static geometry
+   bool viscosity_structure_valid;
+   Array2i u_index, v_index; //unknown of each face in the viscosity system, -1 if it has none
+   std::vector<int> velocity_face; //face (u_ind/v_ind) of each viscosity unknown
+   ViscosityOrdering viscosity_ordering; //how the faces are numbered into unknowns
 
    std::vector<Vec2f> particles; //For marker particle simulation
    float particle_radius;
@@ -41,21 +81,60 @@ public:
    //Data arrays for extrapolation
    Array2c valid, old_valid;
 
-   //Solver data
+   //Solver data (separate solvers so each keeps its own preconditioner structure)
+   bool warm_start_solves; //start from the previous pressure and the current velocities
+   bool mixed_precision_solves; //float matrix, MIC(0) factor and search directions in the CSR solves
+   bool single_reduction_solves; //Chronopoulos-Gear PCG: one combined reduction per iteration
+   MatrixFormat solve_matrix_format; //format of the matrix-vector multiplies in the CSR solves
+   int preconditioner_reuse; //solves a stale MIC(0) factor may serve (0: refactor every solve)
+   bool record_residual_history; //keep every iteration's residual in the solver telemetry
+   bool parallel_assembly; //fill the rows of both systems (and classify the faces) on all OpenMP threads
    PCGSolver<double> solver;
-   SparseMatrixd matrix;
+   PressurePreconditioner pressure_preconditioner;
+   MultigridPreconditioner<double> pressure_multigrid;
+   AdditiveSchwarzPreconditioner<double> pressure_schwarz;
+   ChebyshevPreconditioner<double> pressure_chebyshev;
+   Array2i pressure_index; //unknown of each cell in the pressure system, -1 if it has none
+   std::vector<int> pressure_cell; //grid cell (i + ni*j) of each pressure unknown
+   Array2d pressure_grid; //last solved pressure on the grid, zero outside the liquid
+   SparseMatrixBuilderd matrix_builder; //assembly buffer, compressed into matrix
+   FixedSparseMatrixd matrix;
    std::vector<double> rhs;
    std::vector<double> pressure;
+   bool matrix_free_pressure; //solve pressure with grid_matrix instead of matrix
+   StructuredGridMatrixd grid_matrix;
+   GridMIC0Preconditioner<double> pressure_grid_mic0;
 
-   SparseMatrixd vmatrix;
+   PCGSolver<double> vsolver;
+   SparseMatrixBuilderd vmatrix_builder;
+   FixedSparseMatrixd vmatrix; //structure is reused until the face states change
    std::vector<double> vrhs;
    std::vector<double> velocities;
+   ViscosityPreconditioner viscosity_preconditioner; //AMG or Cholesky for stiff high-viscosity-ratio systems
+   SparseCholesky<double> vcholesky; //symbolic analysis is kept while vmatrix keeps its structure
+   SmoothedAggregationPreconditioner<double> viscosity_amg;
+   AdditiveSchwarzPreconditioner<double> viscosity_schwarz;
+   ChebyshevPreconditioner<double> viscosity_chebyshev;
+   std::vector<double> rigid_modes; //translations and rotation at each viscosity unknown, for viscosity_amg
 
    Vec2f get_velocity(const Vec2f& position);
    void add_particle(const Vec2f& position);
 
+   //Accumulated wall-clock time and call counts for each stage of advance()
+   const StageTimers& get_stage_timers() const { return timers; }
+   void reset_stage_timers() { timers.reset(); }
+
+   //Statistics of the most recent linear solves, oldest first
+   const SolverTelemetry& get_solver_telemetry() const { return telemetry; }
+   void clear_solver_telemetry() { telemetry.clear(); }
+   void set_solver_telemetry_capacity(unsigned int capacity) { telemetry.set_capacity(capacity); }
+
 private:
 
+   StageTimers timers;
+   SolverTelemetry telemetry;
+   long long substep_count; //substeps taken since initialize()
+
    Vec2f trace_rk2(const Vec2f& position, float dt);
 
    void advect_particles(float dt);
@@ -70,12 +149,25 @@ private:
 
    void apply_projection(float dt);
    void compute_pressure_weights();
+   bool number_pressure_unknowns();
    void solve_pressure(float dt);
+   template<class MatrixT> void build_pressure_system(MatrixT& target, float dt);
    
    int u_ind(int i, int j);
    int v_ind(int i, int j);
    void apply_viscosity(float dt);
    void compute_viscosity_weights();
+   void compute_viscosity_states();
+   bool has_u_unknown(int i, int j);
+   bool has_v_unknown(int i, int j);
+   void number_viscosity_cell(int i, int j);
+   bool number_viscosity_unknowns();
+   template<class Stencil, int F> void viscous_flux_weights(int i, int j, float factor, float* weight, std::true_type);
+   template<class Stencil, int F> void viscous_flux_weights(int i, int j, float factor, float* weight, std::false_type);
+   template<class Stencil, int T> void add_viscous_terms(int index, int i, int j, const float* weight, std::true_type);
+   template<class Stencil, int T> void add_viscous_terms(int index, int i, int j, const float* weight, std::false_type);
+   template<class Stencil> void add_viscous_row(int index, int i, int j, float volume, float velocity, float factor);
+   void build_viscosity_system(float dt, bool rebuild_structure);
    void solve_viscosity(float dt);
 
    void constrain_velocity();
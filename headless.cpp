@@ -0,0 +1,354 @@
+//Headless batch driver: runs the solver flat-out with no display, for
+//render-farm nodes and timing runs. Links only fluidsim.cpp, scenes.cpp
+//and the pcgsolver headers - no GL/GLUT.
+//
+//Usage: headless [-res N] [-dt T] [-frames F] [-scene all|column|beam|disk]
+//                [-stats-csv FILE] [-stats-json FILE]
+//                [-pressure-precond mic0|mg|schwarz|chebyshev]
+//                [-matrix-free-pressure] [-mixed-precision] [-single-reduction]
+//                [-reuse-precond N] [-viscosity-precond mic0|amg|cholesky|schwarz|chebyshev]
+//                [-direct-viscosity] [-schwarz-blocks N] [-schwarz-overlap L] [-chebyshev-degree K]
+//                [-spmv csr|sell|symmetric] [-sell] [-solver-csv FILE] [-residual-history]
+//                [-serial-assembly] [-viscosity-order separate|interleaved|morton]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "fluidsim.h"
+#include "scenes.h"
+
+using namespace std;
+
+static void usage(const char* program) {
+   printf("Usage: %s [-res N] [-dt T] [-frames F] [-scene all|column|beam|disk]\n", program);
+   printf("          [-stats-csv FILE] [-stats-json FILE]\n");
+   printf("          [-pressure-precond mic0|mg|schwarz|chebyshev]\n");
+   printf("          [-matrix-free-pressure] [-mixed-precision] [-single-reduction]\n");
+   printf("          [-reuse-precond N] [-viscosity-precond mic0|amg|cholesky|schwarz|chebyshev]\n");
+   printf("          [-direct-viscosity] [-schwarz-blocks N] [-schwarz-overlap L] [-chebyshev-degree K]\n");
+   printf("          [-spmv csr|sell|symmetric] [-sell] [-solver-csv FILE] [-residual-history]\n");
+   printf("          [-serial-assembly] [-viscosity-order separate|interleaved|morton]\n");
+   printf("   -res N      grid resolution (N x N cells, default 100)\n");
+   printf("   -dt T       frame timestep (default 0.002)\n");
+   printf("   -frames F   number of frames to simulate (default 100)\n");
+   printf("   -scene S    initial liquid configuration (default all)\n");
+   printf("   -stats-csv FILE, -stats-json FILE\n");
+   printf("               write the per-stage timings of advance() after the run\n");
+   printf("   -pressure-precond P\n");
+   printf("               pressure preconditioner: mic0 (default), mg (multigrid), schwarz\n");
+   printf("               (MIC(0) per subdomain, in parallel; CSR systems only) or chebyshev\n");
+   printf("               (Jacobi-scaled Chebyshev polynomial, multiplies only)\n");
+   printf("   -matrix-free-pressure\n");
+   printf("               store the pressure system as a 5-point grid stencil instead of CSR\n");
+   printf("   -mixed-precision\n");
+   printf("               float storage with double accumulation in the MIC(0) CSR solves\n");
+   printf("   -single-reduction\n");
+   printf("               Chronopoulos-Gear PCG, one combined reduction per iteration\n");
+   printf("   -spmv F     matrix format of the multiplies in the CSR solves: csr (default),\n");
+   printf("               sell (sliced ELLPACK, SELL-C-sigma) or symmetric (lower triangle only)\n");
+   printf("   -sell       same as -spmv sell\n");
+   printf("   -reuse-precond N\n");
+   printf("               reuse a MIC(0) factor for up to N more solves (default 0)\n");
+   printf("   -viscosity-precond P\n");
+   printf("               viscosity preconditioner: mic0 (default), amg (smoothed aggregation),\n");
+   printf("               cholesky (complete sparse Cholesky, converging in one or two iterations)\n");
+   printf("               schwarz or chebyshev\n");
+   printf("   -schwarz-blocks N, -schwarz-overlap L\n");
+   printf("               subdomains of the schwarz preconditioners (default one per thread)\n");
+   printf("               and layers of overlap between them (default 1; 0 is block Jacobi)\n");
+   printf("   -chebyshev-degree K\n");
+   printf("               Chebyshev steps per preconditioner application (default 4)\n");
+   printf("   -direct-viscosity\n");
+   printf("               same as -viscosity-precond cholesky\n");
+   printf("   -solver-csv FILE\n");
+   printf("               write one line per linear solve (size, iterations, residuals, timings)\n");
+   printf("   -residual-history\n");
+   printf("               also record the residual of every PCG iteration\n");
+   printf("   -serial-assembly\n");
+   printf("               assemble both systems on one thread (the default uses all OpenMP threads)\n");
+   printf("   -viscosity-order O\n");
+   printf("               numbering of the viscosity unknowns: separate (all u faces, then all v\n");
+   printf("               faces; default), interleaved (u and v face of each cell together, row by\n");
+   printf("               row) or morton (the same, cells along a Z-order curve)\n");
+}
+
+static double seconds_since(const chrono::steady_clock::time_point& start) {
+   return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+   int grid_resolution = 100;
+   float timestep = 0.002f;
+   int frames = 100;
+   SceneType scene = SCENE_ALL;
+   float grid_width = 1;
+   const char* stats_csv = 0;
+   const char* stats_json = 0;
+   PressurePreconditioner pressure_preconditioner = PRESSURE_PRECONDITIONER_MIC0;
+   bool matrix_free_pressure = false;
+   bool mixed_precision = false;
+   bool single_reduction = false;
+   MatrixFormat matrix_format = MATRIX_FORMAT_CSR;
+   int preconditioner_reuse = 0;
+   ViscosityPreconditioner viscosity_preconditioner = VISCOSITY_PRECONDITIONER_MIC0;
+   int schwarz_blocks = 0;
+   int schwarz_overlap = 1;
+   int chebyshev_degree = 4;
+   const char* solver_csv = 0;
+   bool residual_history = false;
+   bool serial_assembly = false;
+   ViscosityOrdering viscosity_ordering = VISCOSITY_ORDERING_SEPARATE;
+
+   for(int a = 1; a < argc; ++a) {
+      bool has_value = a+1 < argc;
+      if(strcmp(argv[a], "-res") == 0 && has_value)
+         grid_resolution = atoi(argv[++a]);
+      else if(strcmp(argv[a], "-dt") == 0 && has_value)
+         timestep = (float)atof(argv[++a]);
+      else if(strcmp(argv[a], "-frames") == 0 && has_value)
+         frames = atoi(argv[++a]);
+      else if(strcmp(argv[a], "-stats-csv") == 0 && has_value)
+         stats_csv = argv[++a];
+      else if(strcmp(argv[a], "-stats-json") == 0 && has_value)
+         stats_json = argv[++a];
+      else if(strcmp(argv[a], "-matrix-free-pressure") == 0)
+         matrix_free_pressure = true;
+      else if(strcmp(argv[a], "-mixed-precision") == 0)
+         mixed_precision = true;
+      else if(strcmp(argv[a], "-single-reduction") == 0)
+         single_reduction = true;
+      else if(strcmp(argv[a], "-sell") == 0)
+         matrix_format = MATRIX_FORMAT_SLICED_ELL;
+      else if(strcmp(argv[a], "-spmv") == 0 && has_value) {
+         ++a;
+         if(strcmp(argv[a], "csr") == 0)
+            matrix_format = MATRIX_FORMAT_CSR;
+         else if(strcmp(argv[a], "sell") == 0)
+            matrix_format = MATRIX_FORMAT_SLICED_ELL;
+         else if(strcmp(argv[a], "symmetric") == 0)
+            matrix_format = MATRIX_FORMAT_SYMMETRIC;
+         else {
+            usage(argv[0]);
+            return 1;
+         }
+      }
+      else if(strcmp(argv[a], "-reuse-precond") == 0 && has_value)
+         preconditioner_reuse = atoi(argv[++a]);
+      else if(strcmp(argv[a], "-direct-viscosity") == 0)
+         viscosity_preconditioner = VISCOSITY_PRECONDITIONER_CHOLESKY;
+      else if(strcmp(argv[a], "-viscosity-precond") == 0 && has_value) {
+         ++a;
+         if(strcmp(argv[a], "mic0") == 0)
+            viscosity_preconditioner = VISCOSITY_PRECONDITIONER_MIC0;
+         else if(strcmp(argv[a], "amg") == 0)
+            viscosity_preconditioner = VISCOSITY_PRECONDITIONER_AMG;
+         else if(strcmp(argv[a], "cholesky") == 0)
+            viscosity_preconditioner = VISCOSITY_PRECONDITIONER_CHOLESKY;
+         else if(strcmp(argv[a], "schwarz") == 0)
+            viscosity_preconditioner = VISCOSITY_PRECONDITIONER_SCHWARZ;
+         else if(strcmp(argv[a], "chebyshev") == 0)
+            viscosity_preconditioner = VISCOSITY_PRECONDITIONER_CHEBYSHEV;
+         else {
+            usage(argv[0]);
+            return 1;
+         }
+      }
+      else if(strcmp(argv[a], "-schwarz-blocks") == 0 && has_value)
+         schwarz_blocks = atoi(argv[++a]);
+      else if(strcmp(argv[a], "-schwarz-overlap") == 0 && has_value)
+         schwarz_overlap = atoi(argv[++a]);
+      else if(strcmp(argv[a], "-chebyshev-degree") == 0 && has_value)
+         chebyshev_degree = atoi(argv[++a]);
+      else if(strcmp(argv[a], "-solver-csv") == 0 && has_value)
+         solver_csv = argv[++a];
+      else if(strcmp(argv[a], "-residual-history") == 0)
+         residual_history = true;
+      else if(strcmp(argv[a], "-serial-assembly") == 0)
+         serial_assembly = true;
+      else if(strcmp(argv[a], "-viscosity-order") == 0 && has_value) {
+         ++a;
+         if(strcmp(argv[a], "separate") == 0)
+            viscosity_ordering = VISCOSITY_ORDERING_SEPARATE;
+         else if(strcmp(argv[a], "interleaved") == 0)
+            viscosity_ordering = VISCOSITY_ORDERING_INTERLEAVED;
+         else if(strcmp(argv[a], "morton") == 0)
+            viscosity_ordering = VISCOSITY_ORDERING_MORTON;
+         else {
+            usage(argv[0]);
+            return 1;
+         }
+      }
+      else if(strcmp(argv[a], "-pressure-precond") == 0 && has_value) {
+         ++a;
+         if(strcmp(argv[a], "mic0") == 0)
+            pressure_preconditioner = PRESSURE_PRECONDITIONER_MIC0;
+         else if(strcmp(argv[a], "mg") == 0)
+            pressure_preconditioner = PRESSURE_PRECONDITIONER_MULTIGRID;
+         else if(strcmp(argv[a], "schwarz") == 0)
+            pressure_preconditioner = PRESSURE_PRECONDITIONER_SCHWARZ;
+         else if(strcmp(argv[a], "chebyshev") == 0)
+            pressure_preconditioner = PRESSURE_PRECONDITIONER_CHEBYSHEV;
+         else {
+            usage(argv[0]);
+            return 1;
+         }
+      }
+      else if(strcmp(argv[a], "-scene") == 0 && has_value) {
+         if(!parse_scene(argv[++a], scene)) {
+            printf("Unknown scene '%s'\n", argv[a]);
+            usage(argv[0]);
+            return 1;
+         }
+      }
+      else {
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   if(grid_resolution < 4 || timestep <= 0 || frames < 0 || preconditioner_reuse < 0
+      || schwarz_blocks < 0 || schwarz_overlap < 0 || chebyshev_degree < 1) {
+      usage(argv[0]);
+      return 1;
+   }
+   if(matrix_free_pressure && pressure_preconditioner == PRESSURE_PRECONDITIONER_SCHWARZ) {
+      printf("The schwarz pressure preconditioner needs the CSR pressure system\n");
+      return 1;
+   }
+
+   FluidSim sim;
+   chrono::steady_clock::time_point setup_start = chrono::steady_clock::now();
+   setup_scene(sim, scene, grid_resolution, grid_width);
+   sim.pressure_preconditioner = pressure_preconditioner;
+   sim.matrix_free_pressure = matrix_free_pressure;
+   sim.mixed_precision_solves = mixed_precision;
+   sim.single_reduction_solves = single_reduction;
+   sim.solve_matrix_format = matrix_format;
+   sim.preconditioner_reuse = preconditioner_reuse;
+   sim.viscosity_preconditioner = viscosity_preconditioner;
+   sim.pressure_schwarz.subdomain_count = sim.viscosity_schwarz.subdomain_count = schwarz_blocks;
+   sim.pressure_schwarz.overlap = sim.viscosity_schwarz.overlap = schwarz_overlap;
+   sim.pressure_chebyshev.degree = sim.viscosity_chebyshev.degree = chebyshev_degree;
+   sim.record_residual_history = residual_history;
+   sim.parallel_assembly = !serial_assembly;
+   sim.viscosity_ordering = viscosity_ordering;
+   //keep every solve of the run (two per substep), not just the most recent
+   if(solver_csv)
+      sim.set_solver_telemetry_capacity(1u << 20);
+   double setup_time = seconds_since(setup_start);
+
+   double min_frame = 0, max_frame = 0;
+   chrono::steady_clock::time_point run_start = chrono::steady_clock::now();
+   for(int frame = 0; frame < frames; ++frame) {
+      chrono::steady_clock::time_point frame_start = chrono::steady_clock::now();
+      sim.advance(timestep);
+      double frame_time = seconds_since(frame_start);
+      if(frame == 0 || frame_time < min_frame) min_frame = frame_time;
+      if(frame == 0 || frame_time > max_frame) max_frame = frame_time;
+   }
+   double run_time = seconds_since(run_start);
+
+   printf("\n---- Headless run report ----\n");
+   printf("Scene:            %s\n", scene_name(scene));
+   printf("Grid:             %d x %d (dx = %g)\n", sim.ni, sim.nj, sim.dx);
+   printf("Pressure precond: %s%s\n", pressure_preconditioner == PRESSURE_PRECONDITIONER_MULTIGRID ? "multigrid" :
+      pressure_preconditioner == PRESSURE_PRECONDITIONER_SCHWARZ ? "additive Schwarz MIC(0)" :
+      pressure_preconditioner == PRESSURE_PRECONDITIONER_CHEBYSHEV ? "Chebyshev" : "MIC(0)",
+      matrix_free_pressure ? " (matrix-free)" : "");
+   printf("Solver precision: %s\n", mixed_precision ? "mixed (float storage, double accumulation)" : "double");
+   printf("PCG iteration:    %s\n", single_reduction ? "single-reduction (Chronopoulos-Gear)" : "standard");
+   printf("SpMV format:      %s%s\n", matrix_format == MATRIX_FORMAT_SLICED_ELL ? "SELL-C-sigma" :
+      matrix_format == MATRIX_FORMAT_SYMMETRIC ? "symmetric (lower triangle)" : "CSR",
+      matrix_format != MATRIX_FORMAT_CSR && mixed_precision ? " (ignored: mixed precision multiplies in float CSR)" : "");
+   printf("Viscosity solve:  PCG, %s\n", viscosity_preconditioner == VISCOSITY_PRECONDITIONER_AMG ? "smoothed aggregation AMG" :
+      viscosity_preconditioner == VISCOSITY_PRECONDITIONER_CHOLESKY ? "sparse Cholesky" :
+      viscosity_preconditioner == VISCOSITY_PRECONDITIONER_SCHWARZ ? "additive Schwarz MIC(0)" :
+      viscosity_preconditioner == VISCOSITY_PRECONDITIONER_CHEBYSHEV ? "Chebyshev" : "MIC(0)");
+#ifdef _OPENMP
+   printf("Threads:          %d (OpenMP)\n", omp_get_max_threads());
+#else
+   printf("Threads:          1 (built without OpenMP)\n");
+#endif
+   printf("Assembly:         %s\n", serial_assembly ? "serial" : "parallel rows (OpenMP)");
+   printf("Viscosity order:  %s\n", viscosity_ordering == VISCOSITY_ORDERING_INTERLEAVED ? "interleaved u/v per cell" :
+      viscosity_ordering == VISCOSITY_ORDERING_MORTON ? "interleaved u/v per cell, Morton cell order" : "u faces, then v faces");
+   printf("Particles:        %u\n", (unsigned int)sim.particles.size());
+   printf("Frames:           %d (dt = %g)\n", frames, timestep);
+   printf("Setup time:       %.3f s\n", setup_time);
+   printf("Wall-clock time:  %.3f s\n", run_time);
+   if(frames > 0) {
+      printf("Per frame:        %.3f ms mean, %.3f ms min, %.3f ms max\n",
+         1000*run_time/frames, 1000*min_frame, 1000*max_frame);
+      printf("Throughput:       %.3f frames/s, %.3g cell-frames/s\n",
+         frames/run_time, (double)sim.ni*sim.nj*frames/run_time);
+   }
+
+   if(preconditioner_reuse > 0) {
+      const PreconditionerReuseStats& p = sim.solver.get_reuse_stats();
+      const PreconditionerReuseStats& v = sim.vsolver.get_reuse_stats();
+      printf("MIC(0) reuse:     pressure %d factored / %d reused, viscosity %d factored / %d reused\n",
+         p.factorizations, p.reuses, v.factorizations, v.reuses);
+      printf("                  %.4f s factoring, ~%.4f s saved\n",
+         p.factor_seconds + v.factor_seconds, p.saved_seconds + v.saved_seconds);
+   }
+
+   //Linear solves still held in the telemetry buffer, per system; a long run
+   //may have pushed its oldest solves out, so say when the table is a tail
+   const SolverTelemetry& telemetry = sim.get_solver_telemetry();
+   if(telemetry.total_recorded() > telemetry.size())
+      printf("\nLast %u of %lld solves (the oldest have left the telemetry buffer):", telemetry.size(), telemetry.total_recorded());
+   printf("\nSolve            count   mean iters   max iters   failed   factor (s)   iterate (s)\n");
+   for(int system = 0; system < SOLVE_SYSTEM_COUNT; ++system) {
+      int count = 0, max_iterations = 0, failed = 0;
+      long long iterations = 0;
+      double factor_time = 0, iteration_time = 0;
+      for(unsigned int k = 0; k < telemetry.size(); ++k) {
+         if(telemetry[k].system != system) continue;
+         const PCGSolveStats& stats = telemetry[k].stats;
+         ++count;
+         iterations += stats.iterations;
+         if(stats.iterations > max_iterations) max_iterations = stats.iterations;
+         if(!stats.converged) ++failed;
+         factor_time += stats.factor_seconds;
+         iteration_time += stats.iteration_seconds;
+      }
+      printf("%-14s %7d %12.1f %11d %8d %12.4f %13.4f\n", solve_system_name(system), count,
+         count ? (double)iterations/count : 0.0, max_iterations, failed, factor_time, iteration_time);
+   }
+
+   const StageTimers& timers = sim.get_stage_timers();
+   long long stage_total = timers.total_nanoseconds();
+   printf("\nStage                  calls      total (s)   share\n");
+   //top-level stages, each followed by the stages that are part of it
+   for(int stage = 0; stage < STAGE_COUNT; ++stage) {
+      if(stage_parent(stage) >= 0) continue;
+      printf("%-20s %7lld %14.4f  %5.1f%%\n", stage_name(stage), timers[stage].calls, timers[stage].seconds(),
+         stage_total ? 100.0*timers[stage].nanoseconds/stage_total : 0.0);
+      for(int part = 0; part < STAGE_COUNT; ++part) {
+         if(stage_parent(part) != stage) continue;
+         printf("  %-18s %7lld %14.4f  %5.1f%%\n", stage_name(part), timers[part].calls, timers[part].seconds(),
+            stage_total ? 100.0*timers[part].nanoseconds/stage_total : 0.0);
+      }
+   }
+
+   if(stats_csv) {
+      ofstream output(stats_csv);
+      timers.write_csv(output);
+   }
+   if(stats_json) {
+      ofstream output(stats_json);
+      timers.write_json(output);
+   }
+   if(solver_csv) {
+      ofstream output(solver_csv);
+      telemetry.write_csv(output);
+   }
+
+   return 0;
+}
@@ -9,6 +9,7 @@
 #include "fluidsim.h"
 #include "openglutils.h"
 #include "array2_utils.h"
+#include "scenes.h"
 
 using namespace std;
 
@@ -36,25 +37,6 @@ void mouse(int button, int state, int x, int y);
 void drag(int x, int y);
 void timer(int junk);
 
-//Boundary definition - several circles in a circular domain.
-
-Vec2f c0(0.5f,0.5f), c1(0.7f,0.5f), c2(0.3f,0.35f), c3(0.5f,0.7f);
-float rad0 = 0.4f,  rad1 = 0.1f,  rad2 = 0.1f,   rad3 = 0.1f;
-
-float circle_phi(const Vec2f& position, const Vec2f& centre, float radius) {
-   return (dist(position,centre) - radius);
-}
-
-float boundary_phi(const Vec2f& position) {
-   float phi0 = -circle_phi(position, c0, rad0);
-   float phi1 = circle_phi(position, c1, rad1);
-   float phi2 = circle_phi(position, c2, rad2);
-   float phi3 = circle_phi(position, c3, rad3);
-   
-   return phi0;//min(min(phi0,phi1),min(phi2,phi3));
-}
-
-
 //Main testing code
 //-------------
 int main(int argc, char **argv)
@@ -70,29 +52,8 @@ int main(int argc, char **argv)
    
    glutTimerFunc(1000, timer, 0);
    
-   //Set up the simulation
-   sim.initialize(grid_width, grid_resolution, grid_resolution);
-   
-   //set up a circle boundary
-   sim.set_boundary(boundary_phi);
-   
-   //Stick some liquid particles in the domain
-   int offset = 0;
-   for(int i = 0; i < sqr(grid_resolution); ++i) {
-      for(int parts = 0; parts < 3; ++parts) {
-         float x = randhashf(++offset, 0,1);
-         float y = randhashf(++offset, 0,1);
-         Vec2f pt(x,y);
-         
-         //add a column (for buckling) and a beam (for bending) and a disk (for rolling and flowing)
-         if(boundary_phi(pt) > 0 && (pt[0] > 0.42f && pt[0] < 0.46f || pt[0] < 0.36 && pt[1] > 0.45f && pt[1] < 0.5f || circle_phi(pt, Vec2f(0.7f, 0.65f), 0.15f) < 0))
-            sim.add_particle(pt);
-         
-
-      }
-   }
-
-
+   //Set up the simulation and seed the liquid
+   setup_scene(sim, SCENE_ALL, grid_resolution, grid_width);
 
    Gluvi::run();
 
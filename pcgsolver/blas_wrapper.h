@@ -2,28 +2,78 @@
 #define BLAS_WRAPPER_H
 
 // Simple placeholder code for BLAS calls - replace with calls to a real BLAS library
+//
+// The kernels are threaded with OpenMP for long vectors and written so the
+// compiler can vectorize the inner loops. Sums are taken over fixed blocks of
+// BLOCK_SIZE entries (with four interleaved partial sums in each block) and
+// the block sums are added in order, so a dot product gives the same answer
+// for any number of threads, or without OpenMP at all.
+//
+// Besides the usual BLAS level 1 calls there are a few fused kernels that PCG
+// uses to make fewer passes over memory per iteration. The vectors may hold
+// float or double (mixed freely), but scalars and reductions are always double.
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 namespace BLAS{
 
+const unsigned int BLOCK_SIZE=2048; // entries per partial sum
+const unsigned int MAX_PASS_BLOCKS=64; // blocks summed per parallel pass
+const unsigned int MIN_PARALLEL_SIZE=16384; // shorter vectors are not worth threading
+
+// sum of x[i]*y[i] over one block, with a fixed association order
+template<class X, class Y>
+inline double block_dot(const X *x, const Y *y, unsigned int n)
+{
+   double sum0=0, sum1=0, sum2=0, sum3=0;
+   unsigned int i=0;
+   for(; i+4<=n; i+=4){
+      sum0+=(double)x[i]*y[i];
+      sum1+=(double)x[i+1]*y[i+1];
+      sum2+=(double)x[i+2]*y[i+2];
+      sum3+=(double)x[i+3]*y[i+3];
+   }
+   for(; i<n; ++i)
+      sum0+=(double)x[i]*y[i];
+   return (sum0+sum1)+(sum2+sum3);
+}
+
 // dot products ==============================================================
 
-inline double dot(const std::vector<double> &x, const std::vector<double> &y)
-{ 
-   //return cblas_ddot((int)x.size(), &x[0], 1, &y[0], 1); 
+template<class X, class Y>
+inline double dot(const std::vector<X> &x, const std::vector<Y> &y)
+{
+   //return cblas_ddot((int)x.size(), &x[0], 1, &y[0], 1);
 
-   double sum = 0;
-   for(unsigned int i = 0; i < x.size(); ++i)
-      sum += x[i]*y[i];
+   unsigned int n=(unsigned int)x.size();
+   if(n==0) return 0;
+   const X *xp=&x[0];
+   const Y *yp=&y[0];
+   double sum=0;
+   for(unsigned int start=0; start<n; start+=BLOCK_SIZE*MAX_PASS_BLOCKS){
+      unsigned int end=(n-start>BLOCK_SIZE*MAX_PASS_BLOCKS ? start+BLOCK_SIZE*MAX_PASS_BLOCKS : n);
+      int blocks=(int)((end-start+BLOCK_SIZE-1)/BLOCK_SIZE);
+      double partial[MAX_PASS_BLOCKS];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=MIN_PARALLEL_SIZE)
+#endif
+      for(int b=0; b<blocks; ++b){
+         unsigned int i=start+b*BLOCK_SIZE;
+         partial[b]=block_dot(xp+i, yp+i, (end-i<BLOCK_SIZE ? end-i : BLOCK_SIZE));
+      }
+      for(int b=0; b<blocks; ++b)
+         sum+=partial[b];
+   }
    return sum;
 }
 
 // inf-norm (maximum absolute value: index of max returned) ==================
 
 inline int index_abs_max(const std::vector<double> &x)
-{ 
-   //return cblas_idamax((int)x.size(), &x[0], 1); 
+{
+   //return cblas_idamax((int)x.size(), &x[0], 1);
    int maxind = 0;
    double maxvalue = 0;
    for(unsigned int i = 0; i < x.size(); ++i) {
@@ -38,16 +88,93 @@ inline int index_abs_max(const std::vector<double> &x)
 // inf-norm (maximum absolute value) =========================================
 // technically not part of BLAS, but useful
 
-inline double abs_max(const std::vector<double> &x)
-{ return std::fabs(x[index_abs_max(x)]); }
+template<class X>
+inline double abs_max(const std::vector<X> &x)
+{
+   int n=(int)x.size();
+   const X *xp=(n ? &x[0] : 0);
+   double maxvalue=0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(max:maxvalue) if(n>=(int)MIN_PARALLEL_SIZE)
+#endif
+   for(int i=0; i<n; ++i)
+      maxvalue=std::max(maxvalue, std::fabs((double)xp[i]));
+   return maxvalue;
+}
 
 // saxpy (y=alpha*x+y) =======================================================
 
-inline void add_scaled(double alpha, const std::vector<double> &x, std::vector<double> &y)
-{ 
-   //cblas_daxpy((int)x.size(), alpha, &x[0], 1, &y[0], 1); 
-   for(unsigned int i = 0; i < x.size(); ++i)
-      y[i] += alpha*x[i];
+template<class X, class Y>
+inline void add_scaled(double alpha, const std::vector<X> &x, std::vector<Y> &y)
+{
+   //cblas_daxpy((int)x.size(), alpha, &x[0], 1, &y[0], 1);
+   int n=(int)x.size();
+   if(n==0) return;
+   const X *xp=&x[0];
+   Y *yp=&y[0];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=(int)MIN_PARALLEL_SIZE)
+#endif
+   for(int i=0; i<n; ++i)
+      yp[i]=(Y)(yp[i]+alpha*xp[i]);
+}
+
+// fused kernels =============================================================
+
+// y=alpha*x+y, returning the inf-norm of the new y
+template<class X, class Y>
+inline double add_scaled_abs_max(double alpha, const std::vector<X> &x, std::vector<Y> &y)
+{
+   int n=(int)x.size();
+   if(n==0) return 0;
+   const X *xp=&x[0];
+   Y *yp=&y[0];
+   double maxvalue=0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(max:maxvalue) if(n>=(int)MIN_PARALLEL_SIZE)
+#endif
+   for(int i=0; i<n; ++i){
+      yp[i]=(Y)(yp[i]+alpha*xp[i]);
+      maxvalue=std::max(maxvalue, std::fabs((double)yp[i]));
+   }
+   return maxvalue;
+}
+
+// y=alpha*x+y and w=beta*v+w in one pass, returning the inf-norm of the new w
+// (the PCG solution and residual update)
+template<class X, class Y>
+inline double add_scaled_pair_abs_max(double alpha, const std::vector<X> &x, std::vector<Y> &y,
+                                      double beta, const std::vector<X> &v, std::vector<Y> &w)
+{
+   int n=(int)x.size();
+   if(n==0) return 0;
+   const X *xp=&x[0], *vp=&v[0];
+   Y *yp=&y[0], *wp=&w[0];
+   double maxvalue=0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(max:maxvalue) if(n>=(int)MIN_PARALLEL_SIZE)
+#endif
+   for(int i=0; i<n; ++i){
+      yp[i]=(Y)(yp[i]+alpha*xp[i]);
+      wp[i]=(Y)(wp[i]+beta*vp[i]);
+      maxvalue=std::max(maxvalue, std::fabs((double)wp[i]));
+   }
+   return maxvalue;
+}
+
+// y=alpha*y+x (the PCG search direction update)
+template<class X, class Y>
+inline void scale_and_add(double alpha, const std::vector<X> &x, std::vector<Y> &y)
+{
+   int n=(int)x.size();
+   if(n==0) return;
+   const X *xp=&x[0];
+   Y *yp=&y[0];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=(int)MIN_PARALLEL_SIZE)
+#endif
+   for(int i=0; i<n; ++i)
+      yp[i]=(Y)(alpha*yp[i]+xp[i]);
 }
 
 }
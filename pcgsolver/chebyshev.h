@@ -0,0 +1,213 @@
+#ifndef CHEBYSHEV_H
+#define CHEBYSHEV_H
+
+// Chebyshev polynomial preconditioner: a fixed number of Chebyshev iteration
+// steps on the Jacobi-scaled system D^{-1}A, starting from zero. It is built
+// from matrix-vector multiplies and vector updates only, with no triangular
+// solves, so every part of it threads and vectorizes like the rest of PCG.
+// On wide machines those extra multiplies are cheaper than the sequential
+// substitution of MIC(0).
+//
+// The result is p(D^{-1}A)D^{-1}x for a fixed polynomial p, which is
+// symmetric. It stays positive definite as long as the upper eigenvalue bound
+// really is one, so the estimate is padded. Both bounds come from a few
+// Lanczos steps on D^{-1/2}AD^{-1/2}, done on the first form and then kept
+// (optionally refreshed every so many forms), since the spectrum of the scaled
+// system changes little from one time step to the next.
+//
+// Works with a FixedSparseMatrix or a matrix-free StructuredGridMatrix.
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include "pcg_solver.h"
+#include "grid_matrix.h"
+
+template<class T>
+struct ChebyshevPreconditioner : public Preconditioner<T>
+{
+   // parameters
+   int degree; // Chebyshev steps per application (degree-1 matrix-vector multiplies)
+   int lanczos_steps;
+   T max_eigenvalue_padding; // the Lanczos estimate of the largest eigenvalue is multiplied by this
+   int reestimate_interval; // forms between eigenvalue estimates (0: only the first)
+
+   // current bounds of the spectrum of D^{-1}A (0 until estimated)
+   T min_eigenvalue, max_eigenvalue;
+
+   ChebyshevPreconditioner(void)
+      : degree(4), lanczos_steps(12), max_eigenvalue_padding(1.1f), reestimate_interval(0),
+        min_eigenvalue(0), max_eigenvalue(0), csr(0), grid(0), forms(0)
+   {}
+
+   // forget the eigenvalue bounds, so the next form estimates them again
+   void reset_bounds(void)
+   {
+      min_eigenvalue=max_eigenvalue=0;
+      forms=0;
+   }
+
+   void form(const FixedSparseMatrix<T> &matrix)
+   {
+      csr=&matrix;
+      grid=0;
+      invdiag.assign(matrix.n, 0);
+      for(unsigned int i=0; i<matrix.n; ++i)
+         for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p)
+            if(matrix.colindex[p]==i && matrix.value[p]>0) invdiag[i]=1/matrix.value[p];
+      estimate_bounds();
+   }
+
+   void form(const StructuredGridMatrix<T> &matrix)
+   {
+      csr=0;
+      grid=&matrix;
+      invdiag.assign(matrix.n, 0);
+      for(unsigned int c=0; c<matrix.n; ++c)
+         if(matrix.diag.a[c]>0) invdiag[c]=1/matrix.diag.a[c];
+      estimate_bounds();
+   }
+
+   void apply(const std::vector<T> &x, std::vector<T> &result)
+   {
+      assert(x.size()==invdiag.size());
+      int n=(int)x.size();
+      result.resize(n);
+      z.resize(n);
+      d.resize(n);
+      Ad.resize(n);
+      T theta=(max_eigenvalue+min_eigenvalue)/2, delta=(max_eigenvalue-min_eigenvalue)/2;
+      T sigma=theta/delta, rho=1/sigma;
+      // z: the scaled residual, d: the step
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=(int)BLAS::MIN_PARALLEL_SIZE)
+#endif
+      for(int i=0; i<n; ++i){
+         z[i]=invdiag[i]*x[i];
+         d[i]=z[i]/theta;
+         result[i]=0;
+      }
+      for(int step=0; ; ++step){
+         BLAS::add_scaled(T(1), d, result);
+         if(step+1>=degree) break;
+         multiply_operator(d, Ad);
+         T rho_new=1/(2*sigma-rho);
+         T d_scale=rho_new*rho, z_scale=2*rho_new/delta;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=(int)BLAS::MIN_PARALLEL_SIZE)
+#endif
+         for(int i=0; i<n; ++i){
+            z[i]-=invdiag[i]*Ad[i];
+            d[i]=d_scale*d[i]+z_scale*z[i];
+         }
+         rho=rho_new;
+      }
+   }
+
+   protected:
+
+   const FixedSparseMatrix<T> *csr;
+   const StructuredGridMatrix<T> *grid;
+   std::vector<T> invdiag;
+   std::vector<T> z, d, Ad;
+   int forms;
+
+   void multiply_operator(const std::vector<T> &x, std::vector<T> &result)
+   {
+      if(csr) multiply(*csr, x, result);
+      else multiply(*grid, x, result);
+   }
+
+   void estimate_bounds(void)
+   {
+      bool estimate=(max_eigenvalue<=0 || (reestimate_interval>0 && forms%reestimate_interval==0));
+      ++forms;
+      if(!estimate) return;
+
+      // Lanczos on the symmetric D^{-1/2}AD^{-1/2}, from a fixed start vector
+      unsigned int n=(unsigned int)invdiag.size();
+      std::vector<T> scale(n), v(n, 0), v_old(n, 0), w(n), Av(n);
+      unsigned int active=0;
+      for(unsigned int i=0; i<n; ++i){
+         scale[i]=std::sqrt(invdiag[i]);
+         if(invdiag[i]>0){
+            v[i]=1+(T)((i*7919u)%113)/113;
+            ++active;
+         }
+      }
+      if(active==0){
+         min_eigenvalue=1;
+         max_eigenvalue=2;
+         return;
+      }
+      T norm=(T)std::sqrt(BLAS::dot(v, v));
+      for(unsigned int i=0; i<n; ++i) v[i]/=norm;
+      std::vector<double> alpha, beta;
+      T beta_prev=0;
+      for(int step=0; step<lanczos_steps && step<(int)active; ++step){
+         for(unsigned int i=0; i<n; ++i) w[i]=scale[i]*v[i];
+         multiply_operator(w, Av);
+         for(unsigned int i=0; i<n; ++i) w[i]=scale[i]*Av[i]-beta_prev*v_old[i];
+         T a=(T)BLAS::dot(w, v);
+         BLAS::add_scaled(-a, v, w);
+         alpha.push_back(a);
+         T b=(T)std::sqrt(BLAS::dot(w, w));
+         if(!(b>1e-12*std::fabs(a))) break; // invariant subspace: the Ritz values are exact
+         beta.push_back(b);
+         v_old.swap(v);
+         for(unsigned int i=0; i<n; ++i) v[i]=w[i]/b;
+         beta_prev=b;
+      }
+      beta.resize(alpha.size()-1);
+      double lowest, highest;
+      tridiagonal_eigenvalue_range(alpha, beta, lowest, highest);
+      max_eigenvalue=(T)(max_eigenvalue_padding*highest);
+      // the lowest Ritz value lies above the true minimum; the polynomial stays
+      // positive below the interval, so that only costs some efficiency
+      min_eigenvalue=(T)std::max(lowest, 1e-6*highest);
+   }
+
+   // smallest and largest eigenvalues of the symmetric tridiagonal matrix with
+   // diagonal alpha and off-diagonal beta, by Sturm sequence bisection
+   static void tridiagonal_eigenvalue_range(const std::vector<double> &alpha, const std::vector<double> &beta,
+                                            double &lowest, double &highest)
+   {
+      unsigned int m=(unsigned int)alpha.size();
+      double lo=alpha[0], hi=alpha[0];
+      for(unsigned int k=0; k<m; ++k){
+         double radius=(k>0 ? std::fabs(beta[k-1]) : 0)+(k+1<m ? std::fabs(beta[k]) : 0);
+         lo=std::min(lo, alpha[k]-radius);
+         hi=std::max(hi, alpha[k]+radius);
+      }
+      lowest=bisect(alpha, beta, lo, hi, 1);
+      highest=bisect(alpha, beta, lo, hi, m);
+   }
+
+   // the index-th smallest eigenvalue (1-based) within [lo,hi]
+   static double bisect(const std::vector<double> &alpha, const std::vector<double> &beta, double lo, double hi, unsigned int index)
+   {
+      for(int iteration=0; iteration<100 && hi-lo>1e-12*std::max(std::fabs(lo), std::fabs(hi)); ++iteration){
+         double mid=(lo+hi)/2;
+         if(eigenvalues_below(alpha, beta, mid)>=index) hi=mid;
+         else lo=mid;
+      }
+      return (lo+hi)/2;
+   }
+
+   // number of eigenvalues less than x (Sturm sequence)
+   static unsigned int eigenvalues_below(const std::vector<double> &alpha, const std::vector<double> &beta, double x)
+   {
+      unsigned int count=0;
+      double q=1;
+      for(unsigned int k=0; k<alpha.size(); ++k){
+         double b2=(k>0 ? beta[k-1]*beta[k-1] : 0);
+         q=alpha[k]-x-(k>0 ? b2/q : 0);
+         if(q==0) q=1e-300;
+         if(q<0) ++count;
+      }
+      return count;
+   }
+};
+
+#endif
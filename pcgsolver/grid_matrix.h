@@ -0,0 +1,202 @@
+#ifndef GRID_MATRIX_H
+#define GRID_MATRIX_H
+
+// Matrix-free storage for symmetric 5-point systems on a regular ni x nj grid
+// of cells (unknown i+ni*j), such as the variational pressure system. Only the
+// diagonal and the couplings to the +x and +y neighbours are kept, as Array2
+// fields; the -x/-y couplings follow by symmetry. There are no column indices
+// at all, so a matrix-vector multiply streams three coefficient arrays and the
+// vectors with unit stride.
+//
+// GridMIC0Preconditioner is the matching modified incomplete Cholesky
+// preconditioner, computed straight from the stencil fields.
+
+#include <cassert>
+#include <stdexcept>
+#include <vector>
+#include "array2.h"
+#include "pcg_solver.h"
+
+template<class T>
+struct StructuredGridMatrix
+{
+   int ni, nj;
+   unsigned int n; // dimension, ni*nj
+   Array2<T, Array1<T> > diag; // a(c,c)
+   Array2<T, Array1<T> > xplus; // a(c,c+1), zero in the last column
+   Array2<T, Array1<T> > yplus; // a(c,c+ni), zero in the last row
+
+   StructuredGridMatrix(void)
+      : ni(0), nj(0), n(0)
+   {}
+
+   void resize(int ni_, int nj_)
+   {
+      ni=ni_;
+      nj=nj_;
+      n=(unsigned int)(ni*nj);
+      diag.resize(ni, nj);
+      xplus.resize(ni, nj);
+      yplus.resize(ni, nj);
+   }
+
+   void zero(void)
+   {
+      diag.set_zero();
+      xplus.set_zero();
+      yplus.set_zero();
+   }
+
+   // Same interface as SparseMatrixBuilder, so the same assembly code can fill
+   // either. Entries below the diagonal are implied by symmetry and ignored.
+   void add_to_element(unsigned int row, unsigned int col, T increment_value)
+   {
+      if(col==row) diag.a[row]+=increment_value;
+      else if(col==row+1) xplus.a[row]+=increment_value;
+      else if(col==row+ni) yplus.a[row]+=increment_value;
+      else assert(col<row); // not a 5-point stencil entry
+   }
+
+   void set_element(unsigned int row, unsigned int col, T new_value)
+   {
+      if(col==row) diag.a[row]=new_value;
+      else if(col==row+1) xplus.a[row]=new_value;
+      else if(col==row+ni) yplus.a[row]=new_value;
+      else assert(col<row);
+   }
+
+   // non-zero entries of the full (symmetric) matrix, as CSR would store them
+   unsigned int nonzeros(void) const
+   {
+      unsigned int count=0;
+      for(unsigned int c=0; c<n; ++c)
+         count+=(diag.a[c]!=0)+2*(xplus.a[c]!=0)+2*(yplus.a[c]!=0);
+      return count;
+   }
+};
+
+typedef StructuredGridMatrix<float> StructuredGridMatrixf;
+typedef StructuredGridMatrix<double> StructuredGridMatrixd;
+
+// perform result=matrix*x
+template<class T>
+void multiply(const StructuredGridMatrix<T> &matrix, const std::vector<T> &x, std::vector<T> &result)
+{
+   assert(matrix.n==x.size());
+   result.resize(matrix.n);
+   int ni=matrix.ni, nj=matrix.nj;
+   if(matrix.n==0) return;
+   const T *diag=&matrix.diag.a[0], *xplus=&matrix.xplus.a[0], *yplus=&matrix.yplus.a[0];
+   const T *xv=&x[0];
+   T *out=&result[0];
+   // rows of cells are independent
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(matrix.n>=BLAS::MIN_PARALLEL_SIZE)
+#endif
+   for(int j=0; j<nj; ++j){
+      int row=ni*j;
+      // the first and last cell of each row are done separately so the inner loop has no branches
+      for(int i=0; i<ni; i+=(ni>1 ? ni-1 : 1)){
+         int c=row+i;
+         T sum=diag[c]*xv[c];
+         if(i+1<ni) sum+=xplus[c]*xv[c+1];
+         if(i>0) sum+=xplus[c-1]*xv[c-1];
+         if(j+1<nj) sum+=yplus[c]*xv[c+ni];
+         if(j>0) sum+=yplus[c-ni]*xv[c-ni];
+         out[c]=sum;
+      }
+      if(j>0 && j+1<nj){
+         for(int c=row+1; c<row+ni-1; ++c)
+            out[c]=diag[c]*xv[c]+xplus[c]*xv[c+1]+xplus[c-1]*xv[c-1]+yplus[c]*xv[c+ni]+yplus[c-ni]*xv[c-ni];
+      }else{
+         for(int c=row+1; c<row+ni-1; ++c){
+            T sum=diag[c]*xv[c]+xplus[c]*xv[c+1]+xplus[c-1]*xv[c-1];
+            if(j+1<nj) sum+=yplus[c]*xv[c+ni];
+            if(j>0) sum+=yplus[c-ni]*xv[c-ni];
+            out[c]=sum;
+         }
+      }
+   }
+}
+
+//============================================================================
+// MIC(0) for a StructuredGridMatrix, in the classic grid form: precon holds
+// the reciprocal of the factor's diagonal, and the off-diagonals of the factor
+// are the matrix couplings scaled by it.
+
+template<class T>
+struct GridMIC0Preconditioner : public Preconditioner<T>
+{
+   T modification_parameter; // tau: 0 is plain incomplete Cholesky, 1 fully modified
+   T min_diagonal_ratio; // sigma: fall back to the matrix diagonal below this fraction of it
+   Array2<T, Array1<T> > precon;
+   std::vector<T> q;
+
+   GridMIC0Preconditioner(void)
+      : modification_parameter(0.97f), min_diagonal_ratio(0.25f), matrix(0)
+   {}
+
+   // Preconditioner interface - only the StructuredGridMatrix form is supported,
+   // so a CSR solve with this preconditioner set fails here, in any build
+   void form(const FixedSparseMatrix<T> &)
+   {
+      matrix=0;
+      throw std::logic_error("GridMIC0Preconditioner needs a StructuredGridMatrix");
+   }
+
+   void form(const StructuredGridMatrix<T> &matrix_)
+   {
+      matrix=&matrix_;
+      int ni=matrix->ni, nj=matrix->nj;
+      precon.resize(ni, nj);
+      precon.set_zero();
+      const Array2<T, Array1<T> > &diag=matrix->diag, &xplus=matrix->xplus, &yplus=matrix->yplus;
+      for(int j=0; j<nj; ++j) for(int i=0; i<ni; ++i){
+         if(diag(i,j)==0) continue;
+         T e=diag(i,j);
+         if(i>0){
+            T px=xplus(i-1,j)*precon(i-1,j);
+            e-=px*px+modification_parameter*xplus(i-1,j)*(j+1<nj ? yplus(i-1,j) : 0)*sqr(precon(i-1,j));
+         }
+         if(j>0){
+            T py=yplus(i,j-1)*precon(i,j-1);
+            e-=py*py+modification_parameter*yplus(i,j-1)*(i+1<ni ? xplus(i,j-1) : 0)*sqr(precon(i,j-1));
+         }
+         if(e<min_diagonal_ratio*diag(i,j)) e=diag(i,j);
+         precon(i,j)=1/std::sqrt(e);
+      }
+   }
+
+   void apply(const std::vector<T> &x, std::vector<T> &result)
+   {
+      assert(matrix && x.size()==matrix->n);
+      int ni=matrix->ni, nj=matrix->nj;
+      const Array2<T, Array1<T> > &xplus=matrix->xplus, &yplus=matrix->yplus;
+      q.resize(x.size());
+      result.resize(x.size());
+      // solve L*q=x
+      for(int j=0; j<nj; ++j) for(int i=0; i<ni; ++i){
+         int c=i+ni*j;
+         if(precon.a[c]==0){ q[c]=0; continue; }
+         T t=x[c];
+         if(i>0) t-=xplus(i-1,j)*precon(i-1,j)*q[c-1];
+         if(j>0) t-=yplus(i,j-1)*precon(i,j-1)*q[c-ni];
+         q[c]=t*precon.a[c];
+      }
+      // solve L^T*result=q
+      for(int j=nj-1; j>=0; --j) for(int i=ni-1; i>=0; --i){
+         int c=i+ni*j;
+         if(precon.a[c]==0){ result[c]=0; continue; }
+         T t=q[c];
+         if(i+1<ni) t-=xplus(i,j)*precon.a[c]*result[c+1];
+         if(j+1<nj) t-=yplus(i,j)*precon.a[c]*result[c+ni];
+         result[c]=t*precon.a[c];
+      }
+   }
+
+   protected:
+
+   const StructuredGridMatrix<T> *matrix;
+};
+
+#endif
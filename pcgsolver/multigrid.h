@@ -0,0 +1,244 @@
+#ifndef MULTIGRID_H
+#define MULTIGRID_H
+
+// Geometric multigrid V-cycle preconditioner for 5-point systems on a regular
+// ni x nj grid of cells, such as the variational pressure system assembled in
+// FluidSim::solve_pressure. Unknowns are either numbered i+ni*j over the whole
+// grid, or compactly over a subset of cells given by a map to the grid.
+//
+// Coarse operators are Galerkin products with piecewise-constant 2x2
+// aggregation, so every level stays a 5-point stencil and inherits the
+// ghost-fluid free surface terms and cut-cell face weights of the fine matrix
+// exactly, with no need to re-discretize the geometry. Cells without a
+// diagonal entry (air, solid) drop out of every level. Smoothing is red-black
+// Gauss-Seidel, run in reverse order after the coarse correction so that the
+// cycle is symmetric, as PCG requires.
+
+#include <cassert>
+#include "pcg_solver.h"
+#include "grid_matrix.h"
+
+template<class T>
+struct MultigridLevel
+{
+   int ni, nj;
+   std::vector<T> diag; // a(c,c) - zero for cells that are not part of the system
+   std::vector<T> xplus; // a(c,c+1)
+   std::vector<T> yplus; // a(c,c+ni)
+   std::vector<T> x, b, r; // solution, right-hand side and residual
+
+   void resize(int ni_, int nj_)
+   {
+      ni=ni_;
+      nj=nj_;
+      unsigned int n=(unsigned int)(ni*nj);
+      diag.assign(n, 0);
+      xplus.assign(n, 0);
+      yplus.assign(n, 0);
+      x.resize(n);
+      b.resize(n);
+      r.resize(n);
+   }
+
+   // the off-diagonal part of row c applied to x
+   T neighbour_sum(int i, int j) const
+   {
+      int c=i+ni*j;
+      T sum=0;
+      if(i+1<ni) sum+=xplus[c]*x[c+1];
+      if(i>0) sum+=xplus[c-1]*x[c-1];
+      if(j+1<nj) sum+=yplus[c]*x[c+ni];
+      if(j>0) sum+=yplus[c-ni]*x[c-ni];
+      return sum;
+   }
+
+   // one Gauss-Seidel pass over the cells with (i+j)%2==colour
+   void relax(int colour)
+   {
+      for(int j=0; j<nj; ++j){
+         for(int i=(j+colour)%2; i<ni; i+=2){
+            int c=i+ni*j;
+            if(diag[c]!=0) x[c]=(b[c]-neighbour_sum(i,j))/diag[c];
+         }
+      }
+   }
+
+   void compute_residual(void)
+   {
+      for(int j=0; j<nj; ++j) for(int i=0; i<ni; ++i){
+         int c=i+ni*j;
+         r[c]=(diag[c]!=0 ? b[c]-diag[c]*x[c]-neighbour_sum(i,j) : 0);
+      }
+   }
+};
+
+template<class T>
+struct MultigridPreconditioner : public Preconditioner<T>
+{
+   // parameters
+   int pre_sweeps, post_sweeps; // red-black Gauss-Seidel sweeps around each coarse correction
+   int coarse_sweeps; // symmetric sweeps used as the solve on the coarsest level
+   int min_coarse_size; // stop coarsening once either dimension is this small
+   T coarse_scale; // over-correction that compensates for the overly stiff aggregated coarse operators
+
+   std::vector<MultigridLevel<T> > levels;
+
+   MultigridPreconditioner(void)
+      : pre_sweeps(2), post_sweeps(2), coarse_sweeps(20), min_coarse_size(4), coarse_scale(1.8f),
+        ni(0), nj(0)
+   {}
+
+   // grid dimensions of the system: unknown i+ni*j is cell (i,j)
+   void set_grid(int ni_, int nj_)
+   {
+      ni=ni_;
+      nj=nj_;
+      unknown_cell.clear();
+   }
+
+   // compactly numbered system: unknown u is cell unknown_cell_[u] (=i+ni*j)
+   void set_grid(int ni_, int nj_, const std::vector<int> &unknown_cell_)
+   {
+      ni=ni_;
+      nj=nj_;
+      unknown_cell=unknown_cell_;
+   }
+
+   void form(const FixedSparseMatrix<T> &matrix)
+   {
+      assert(matrix.n==(unknown_cell.empty() ? (unsigned int)(ni*nj) : (unsigned int)unknown_cell.size()));
+      allocate_levels();
+
+      // finest level: pick the 5-point stencil out of the matrix
+      MultigridLevel<T> &fine=levels[0];
+      for(unsigned int u=0; u<matrix.n; ++u){
+         int c=cell(u), i=c%ni;
+         const unsigned int *index=matrix.row_index(u);
+         const T *value=matrix.row_value(u);
+         for(unsigned int k=0; k<matrix.row_size(u); ++k){
+            int neighbour=cell(index[k]);
+            if(neighbour==c) fine.diag[c]=value[k];
+            else if(neighbour==c+1 && i+1<ni) fine.xplus[c]=value[k];
+            else if(neighbour==c+ni) fine.yplus[c]=value[k];
+            else assert(neighbour+1==c || neighbour+ni==c); // must be a 5-point stencil
+         }
+      }
+      coarsen();
+   }
+
+   // matrix-free form: the finest level is the stencil itself
+   void form(const StructuredGridMatrix<T> &matrix)
+   {
+      set_grid(matrix.ni, matrix.nj);
+      allocate_levels();
+      levels[0].diag.assign(matrix.diag.a.begin(), matrix.diag.a.end());
+      levels[0].xplus.assign(matrix.xplus.a.begin(), matrix.xplus.a.end());
+      levels[0].yplus.assign(matrix.yplus.a.begin(), matrix.yplus.a.end());
+      coarsen();
+   }
+
+   void apply(const std::vector<T> &x, std::vector<T> &result)
+   {
+      assert(!levels.empty());
+      MultigridLevel<T> &fine=levels[0];
+      if(unknown_cell.empty()){
+         assert(x.size()==fine.b.size());
+         for(unsigned int c=0; c<x.size(); ++c)
+            fine.b[c]=(fine.diag[c]!=0 ? x[c] : 0);
+         v_cycle(0);
+         result=fine.x;
+         return;
+      }
+      assert(x.size()==unknown_cell.size());
+      zero(fine.b);
+      for(unsigned int u=0; u<x.size(); ++u){
+         int c=unknown_cell[u];
+         if(fine.diag[c]!=0) fine.b[c]=x[u];
+      }
+      v_cycle(0);
+      result.resize(x.size());
+      for(unsigned int u=0; u<x.size(); ++u)
+         result[u]=fine.x[unknown_cell[u]];
+   }
+
+   protected:
+
+   int ni, nj;
+   std::vector<int> unknown_cell; // grid cell of each unknown (empty: unknown i+ni*j is cell (i,j))
+
+   int cell(unsigned int u) const
+   { return unknown_cell.empty() ? (int)u : unknown_cell[u]; }
+
+   void allocate_levels(void)
+   {
+      unsigned int level_count=1;
+      for(int li=ni, lj=nj; li>min_coarse_size && lj>min_coarse_size; li=(li+1)/2, lj=(lj+1)/2)
+         ++level_count;
+      levels.resize(level_count);
+      levels[0].resize(ni, nj);
+   }
+
+   // coarser levels: Galerkin product with 2x2 aggregation
+   void coarsen(void)
+   {
+      for(unsigned int l=1; l<levels.size(); ++l){
+         const MultigridLevel<T> &f=levels[l-1];
+         MultigridLevel<T> &g=levels[l];
+         g.resize((f.ni+1)/2, (f.nj+1)/2);
+         for(int j=0; j<f.nj; ++j) for(int i=0; i<f.ni; ++i){
+            int c=i+f.ni*j;
+            if(f.diag[c]==0) continue;
+            int C=i/2+g.ni*(j/2);
+            g.diag[C]+=f.diag[c];
+            if(i+1<f.ni){
+               if((i+1)/2==i/2) g.diag[C]+=2*f.xplus[c]; // coupling inside the aggregate
+               else g.xplus[C]+=f.xplus[c];
+            }
+            if(j+1<f.nj){
+               if((j+1)/2==j/2) g.diag[C]+=2*f.yplus[c];
+               else g.yplus[C]+=f.yplus[c];
+            }
+         }
+      }
+   }
+
+   void v_cycle(unsigned int l)
+   {
+      MultigridLevel<T> &f=levels[l];
+      zero(f.x);
+      if(l+1==levels.size()){
+         for(int sweep=0; sweep<coarse_sweeps; ++sweep){
+            f.relax(0); f.relax(1);
+         }
+         for(int sweep=0; sweep<coarse_sweeps; ++sweep){
+            f.relax(1); f.relax(0);
+         }
+         return;
+      }
+
+      for(int sweep=0; sweep<pre_sweeps; ++sweep){
+         f.relax(0); f.relax(1);
+      }
+
+      // restrict the residual by summing over each aggregate
+      MultigridLevel<T> &g=levels[l+1];
+      f.compute_residual();
+      zero(g.b);
+      for(int j=0; j<f.nj; ++j) for(int i=0; i<f.ni; ++i)
+         g.b[i/2+g.ni*(j/2)]+=f.r[i+f.ni*j];
+
+      v_cycle(l+1);
+
+      // prolongate the coarse correction by injection
+      for(int j=0; j<f.nj; ++j) for(int i=0; i<f.ni; ++i){
+         int c=i+f.ni*j;
+         if(f.diag[c]!=0) f.x[c]+=coarse_scale*g.x[i/2+g.ni*(j/2)];
+      }
+
+      for(int sweep=0; sweep<post_sweeps; ++sweep){
+         f.relax(1); f.relax(0);
+      }
+   }
+};
+
+#endif
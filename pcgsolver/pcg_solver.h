@@ -7,8 +7,11 @@
 // with guarantees made only for M-matrices (where off-diagonal entries are all
 // non-positive, and row sums are non-negative).
 
+#include <chrono>
 #include <cmath>
 #include "sparse_matrix.h"
+#include "sliced_ell.h"
+#include "symmetric_matrix.h"
 #include "blas_wrapper.h"
 
 //============================================================================
@@ -24,14 +27,16 @@ struct SparseColumnLowerFactor
    std::vector<unsigned int> rowindex; // a list of all row indices, for each column in turn
    std::vector<unsigned int> colstart; // where each column begins in rowindex (plus an extra entry at the end, of #nonzeros)
    std::vector<T> adiag; // just used in factorization: minimum "safe" diagonal entry allowed
+   unsigned int structure_stamp; // structure_stamp of the matrix that colstart/rowindex were built for (0 if none)
 
    explicit SparseColumnLowerFactor(unsigned int n_=0)
-      : n(n_), invdiag(n_), colstart(n_+1), adiag(n_)
+      : n(n_), invdiag(n_), colstart(n_+1), adiag(n_), structure_stamp(0)
    {}
 
    void clear(void)
    {
       n=0;
+      structure_stamp=0;
       invdiag.clear();
       value.clear();
       rowindex.clear();
@@ -41,6 +46,7 @@ struct SparseColumnLowerFactor
 
    void resize(unsigned int n_)
    {
+      if(n_!=n) structure_stamp=0;
       n=n_;
       invdiag.resize(n);
       colstart.resize(n+1);
@@ -81,29 +87,51 @@ struct SparseColumnLowerFactor
 // results. The min_diagonal_ratio parameter is used to detect and correct
 // problems in factorization: if a pivot is this much less than the diagonal
 // entry from the original matrix, the original matrix entry is used instead.
+// The matrix may be a SparseMatrix or a FixedSparseMatrix (anything with sorted
+// row_size/row_index/row_value access).
 
-template<class T>
-void factor_modified_incomplete_cholesky0(const SparseMatrix<T> &matrix, SparseColumnLowerFactor<T> &factor,
+template<class T, class MatrixT>
+void factor_modified_incomplete_cholesky0(const MatrixT &matrix, SparseColumnLowerFactor<T> &factor,
                                           T modification_parameter=0.97, T min_diagonal_ratio=0.25)
 {
    // first copy lower triangle of matrix into factor (Note: assuming A is symmetric of course!)
+   // The column structure is only rebuilt when the matrix structure has changed.
+   unsigned int stamp=matrix_structure_stamp(matrix);
+   bool same_structure=(stamp!=0 && stamp==factor.structure_stamp && factor.n==matrix.n);
    factor.resize(matrix.n);
    zero(factor.invdiag); // important: eliminate old values from previous solves!
-   factor.value.resize(0);
-   factor.rowindex.resize(0);
    zero(factor.adiag);
+   if(!same_structure){
+      factor.colstart[0]=0;
+      for(unsigned int i=0; i<matrix.n; ++i){
+         const unsigned int *index=matrix.row_index(i);
+         unsigned int below=0;
+         for(unsigned int j=0; j<matrix.row_size(i); ++j)
+            if(index[j]>i) ++below;
+         factor.colstart[i+1]=factor.colstart[i]+below;
+      }
+      factor.rowindex.resize(factor.colstart[matrix.n]);
+      factor.value.resize(factor.colstart[matrix.n]);
+      for(unsigned int i=0; i<matrix.n; ++i){
+         const unsigned int *index=matrix.row_index(i);
+         unsigned int p=factor.colstart[i];
+         for(unsigned int j=0; j<matrix.row_size(i); ++j)
+            if(index[j]>i) factor.rowindex[p++]=index[j];
+      }
+      factor.structure_stamp=stamp;
+   }
    for(unsigned int i=0; i<matrix.n; ++i){
-      factor.colstart[i]=(unsigned int)factor.rowindex.size();
-      for(unsigned int j=0; j<matrix.index[i].size(); ++j){
-         if(matrix.index[i][j]>i){
-            factor.rowindex.push_back(matrix.index[i][j]);
-            factor.value.push_back(matrix.value[i][j]);
-         }else if(matrix.index[i][j]==i){
-            factor.invdiag[i]=factor.adiag[i]=matrix.value[i][j];
+      const unsigned int *index=matrix.row_index(i);
+      const T *value=matrix.row_value(i);
+      unsigned int p=factor.colstart[i];
+      for(unsigned int j=0; j<matrix.row_size(i); ++j){
+         if(index[j]>i){
+            factor.value[p++]=value[j];
+         }else if(index[j]==i){
+            factor.invdiag[i]=factor.adiag[i]=value[j];
          }
       }
    }
-   factor.colstart[matrix.n]=(unsigned int)factor.rowindex.size();
    // now do the incomplete factorization (figure out numerical values)
 
    // MATLAB code:
@@ -141,12 +169,14 @@ void factor_modified_incomplete_cholesky0(const SparseMatrix<T> &matrix, SparseC
          unsigned int a=factor.colstart[k];
          // first look for contributions to missing from dropped entries above the diagonal in column j
          unsigned int b=0;
+         const unsigned int *index_j=matrix.row_index(j);
+         unsigned int size_j=matrix.row_size(j);
          while(a<factor.colstart[k+1] && factor.rowindex[a]<j){
-            // look for factor.rowindex[a] in matrix.index[j] starting at b
-            while(b<matrix.index[j].size()){
-               if(matrix.index[j][b]<factor.rowindex[a])
+            // look for factor.rowindex[a] in row j of the matrix starting at b
+            while(b<size_j){
+               if(index_j[b]<factor.rowindex[a])
                   ++b;
-               else if(matrix.index[j][b]==factor.rowindex[a])
+               else if(index_j[b]==factor.rowindex[a])
                   break;
                else{
                   missing+=factor.value[a];
@@ -188,13 +218,13 @@ void factor_modified_incomplete_cholesky0(const SparseMatrix<T> &matrix, SparseC
 //============================================================================
 // Solution routines with lower triangular matrix.
 
-// solve L*result=rhs
-template<class T>
-void solve_lower(const SparseColumnLowerFactor<T> &factor, const std::vector<T> &rhs, std::vector<T> &result)
+// solve L*result=rhs (rhs may be held in another precision than the factor)
+template<class T, class S>
+void solve_lower(const SparseColumnLowerFactor<T> &factor, const std::vector<S> &rhs, std::vector<T> &result)
 {
    assert(factor.n==rhs.size());
    assert(factor.n==result.size());
-   result=rhs;
+   result.assign(rhs.begin(), rhs.end());
    for(unsigned int i=0; i<factor.n; ++i){
       result[i]*=factor.invdiag[i];
       for(unsigned int j=factor.colstart[i]; j<factor.colstart[i+1]; ++j){
@@ -219,18 +249,342 @@ void solve_lower_transpose_in_place(const SparseColumnLowerFactor<T> &factor, st
    }while(i!=0);
 }
 
+//============================================================================
+// Level scheduling for the triangular solves. Row i of L can be solved as
+// soon as every row it depends on is done, so rows are grouped into
+// dependency levels (wavefronts) and each level is handed out across threads.
+// The schedule depends only on the sparsity structure, so it is rebuilt only
+// when the factor's structure changes. Each row still subtracts its terms in
+// ascending column order, exactly as the serial solves do, so the results are
+// bit-identical to solve_lower/solve_lower_transpose_in_place.
+
+template<class T>
+struct SparseColumnLowerSchedule
+{
+   unsigned int n;
+   unsigned int structure_stamp; // factor structure this was built for (0: rebuild every time)
+   // strictly lower part of L by rows, as positions into factor.value, for the gather-form L solve
+   std::vector<unsigned int> rowstart, colindex, position;
+   // rows grouped by level, for L (forwards) and L^T (backwards)
+   std::vector<unsigned int> lower_order, lower_levelstart;
+   std::vector<unsigned int> upper_order, upper_levelstart;
+   std::vector<unsigned int> level; // scratch
+
+   SparseColumnLowerSchedule(void)
+      : n(0), structure_stamp(0)
+   {}
+
+   void analyze(const SparseColumnLowerFactor<T> &factor)
+   {
+      if(factor.structure_stamp!=0 && factor.structure_stamp==structure_stamp && factor.n==n) return;
+      n=factor.n;
+      structure_stamp=factor.structure_stamp;
+
+      // transpose the column structure into rows (columns visited in ascending order)
+      rowstart.assign(n+1, 0);
+      for(unsigned int p=0; p<factor.rowindex.size(); ++p) ++rowstart[factor.rowindex[p]+1];
+      for(unsigned int i=0; i<n; ++i) rowstart[i+1]+=rowstart[i];
+      colindex.resize(factor.rowindex.size());
+      position.resize(factor.rowindex.size());
+      std::vector<unsigned int> fill(rowstart.begin(), rowstart.end()-1);
+      for(unsigned int k=0; k<n; ++k){
+         for(unsigned int p=factor.colstart[k]; p<factor.colstart[k+1]; ++p){
+            unsigned int q=fill[factor.rowindex[p]]++;
+            colindex[q]=k;
+            position[q]=p;
+         }
+      }
+
+      // L: level(i)=1+max level(k) over the columns k of row i
+      level.assign(n, 0);
+      for(unsigned int i=0; i<n; ++i)
+         for(unsigned int q=rowstart[i]; q<rowstart[i+1]; ++q)
+            level[i]=max(level[i], level[colindex[q]]+1);
+      group_by_level(lower_order, lower_levelstart);
+
+      // L^T: row i needs every row below it in column i
+      level.assign(n, 0);
+      for(unsigned int i=n; i-->0; )
+         for(unsigned int p=factor.colstart[i]; p<factor.colstart[i+1]; ++p)
+            level[i]=max(level[i], level[factor.rowindex[p]]+1);
+      group_by_level(upper_order, upper_levelstart);
+   }
+
+   unsigned int lower_levels(void) const { return lower_levelstart.empty() ? 0 : (unsigned int)lower_levelstart.size()-1; }
+   unsigned int upper_levels(void) const { return upper_levelstart.empty() ? 0 : (unsigned int)upper_levelstart.size()-1; }
+
+   protected:
+
+   // counting sort of the rows by level
+   void group_by_level(std::vector<unsigned int> &order, std::vector<unsigned int> &levelstart)
+   {
+      unsigned int level_count=0;
+      for(unsigned int i=0; i<n; ++i) level_count=max(level_count, level[i]+1);
+      levelstart.assign(level_count+1, 0);
+      for(unsigned int i=0; i<n; ++i) ++levelstart[level[i]+1];
+      for(unsigned int l=0; l<level_count; ++l) levelstart[l+1]+=levelstart[l];
+      order.resize(n);
+      std::vector<unsigned int> fill(levelstart.begin(), levelstart.end()-1);
+      for(unsigned int i=0; i<n; ++i) order[fill[level[i]]++]=i;
+   }
+};
+
+// below this many unknowns per level on average, the barriers cost more than they save
+const unsigned int MIN_PARALLEL_LEVEL_SIZE=64;
+
+// solve L*result=rhs, one level at a time
+template<class T, class S>
+void solve_lower_scheduled(const SparseColumnLowerFactor<T> &factor, const SparseColumnLowerSchedule<T> &schedule,
+                           const std::vector<S> &rhs, std::vector<T> &result)
+{
+   assert(factor.n==rhs.size());
+   assert(schedule.n==factor.n);
+   result.resize(factor.n);
+   unsigned int levels=schedule.lower_levels();
+#ifdef _OPENMP
+#pragma omp parallel if(levels>0 && factor.n>=MIN_PARALLEL_LEVEL_SIZE*levels)
+#endif
+   for(unsigned int l=0; l<levels; ++l){
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(int a=(int)schedule.lower_levelstart[l]; a<(int)schedule.lower_levelstart[l+1]; ++a){
+         unsigned int i=schedule.lower_order[a];
+         T x=(T)rhs[i];
+         for(unsigned int q=schedule.rowstart[i]; q<schedule.rowstart[i+1]; ++q)
+            x-=factor.value[schedule.position[q]]*result[schedule.colindex[q]];
+         result[i]=x*factor.invdiag[i];
+      }
+   }
+}
+
+// solve L^T*result=rhs in place, one level at a time
+template<class T>
+void solve_lower_transpose_in_place_scheduled(const SparseColumnLowerFactor<T> &factor, const SparseColumnLowerSchedule<T> &schedule,
+                                              std::vector<T> &x)
+{
+   assert(factor.n==x.size());
+   assert(schedule.n==factor.n);
+   unsigned int levels=schedule.upper_levels();
+#ifdef _OPENMP
+#pragma omp parallel if(levels>0 && factor.n>=MIN_PARALLEL_LEVEL_SIZE*levels)
+#endif
+   for(unsigned int l=0; l<levels; ++l){
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+      for(int a=(int)schedule.upper_levelstart[l]; a<(int)schedule.upper_levelstart[l+1]; ++a){
+         unsigned int i=schedule.upper_order[a];
+         T xi=x[i];
+         for(unsigned int j=factor.colstart[i]; j<factor.colstart[i+1]; ++j)
+            xi-=factor.value[j]*x[factor.rowindex[j]];
+         x[i]=xi*factor.invdiag[i];
+      }
+   }
+}
+
+//============================================================================
+// result=matrix*x and dot(x, result), for operators without a fused kernel
+
+template<class OperatorT, class T>
+T multiply_dot(const OperatorT &matrix, const std::vector<T> &x, std::vector<T> &result)
+{
+   multiply(matrix, x, result);
+   return BLAS::dot(x, result);
+}
+
+// result=matrix*x with dot(x, y), dot(x, result) and abs_max(y), for operators
+// without a fused kernel
+template<class OperatorT, class T>
+void multiply_dots(const OperatorT &matrix, const std::vector<T> &x, std::vector<T> &result, const std::vector<T> &y,
+                   double &x_dot_y, double &x_dot_result, double &y_abs_max)
+{
+   multiply(matrix, x, result);
+   x_dot_y=BLAS::dot(x, y);
+   x_dot_result=BLAS::dot(x, result);
+   y_abs_max=BLAS::abs_max(y);
+}
+
+// The vector updates of Chronopoulos-Gear CG in one pass:
+// p=u+beta*p, q=w+beta*q, x+=alpha*p, r-=alpha*q
+template<class T>
+void chronopoulos_gear_update(double alpha, double beta, const std::vector<T> &u, const std::vector<T> &w,
+                              std::vector<T> &p, std::vector<T> &q, std::vector<T> &x, std::vector<T> &r)
+{
+   int n=(int)x.size();
+   if(n==0) return;
+   const T *up=&u[0], *wp=&w[0];
+   T *pp=&p[0], *qp=&q[0], *xp=&x[0], *rp=&r[0];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=(int)BLAS::MIN_PARALLEL_SIZE)
+#endif
+   for(int i=0; i<n; ++i){
+      pp[i]=(T)(up[i]+beta*pp[i]);
+      qp[i]=(T)(wp[i]+beta*qp[i]);
+      xp[i]=(T)(xp[i]+alpha*pp[i]);
+      rp[i]=(T)(rp[i]-alpha*qp[i]);
+   }
+}
+
+//============================================================================
+// Interface for preconditioners other than the built-in MIC(0). form() is
+// called with the system matrix at the start of every solve; apply() must act
+// as a symmetric positive definite operator, result=M^{-1}*x.
+
+template<class T>
+struct Preconditioner
+{
+   virtual ~Preconditioner(void) {}
+   virtual void form(const FixedSparseMatrix<T> &matrix) = 0;
+   virtual void apply(const std::vector<T> &x, std::vector<T> &result) = 0;
+};
+
+//============================================================================
+// Bookkeeping for the stale-preconditioner policy of PCGSolver
+
+struct PreconditionerReuseStats
+{
+   int factorizations; // MIC(0) factors computed
+   int reuses; // solves that used an earlier factor instead
+   double factor_seconds; // time spent computing factors
+   double saved_seconds; // estimated time saved: the mean factorization time per reuse
+
+   PreconditionerReuseStats(void)
+      : factorizations(0), reuses(0), factor_seconds(0), saved_seconds(0)
+   {}
+};
+
+// What the last call to PCGSolver::solve (or solve_operator) did
+struct PCGSolveStats
+{
+   unsigned int n; // system size
+   unsigned int nonzeros; // stored matrix entries (0 for matrix-free operators)
+   int iterations;
+   double initial_residual; // inf-norm of the residual of the initial guess
+   double final_residual;
+   double factor_seconds; // forming the preconditioner (near 0 when a factor was reused)
+   double iteration_seconds; // the rest of the solve
+   bool converged;
+   std::vector<double> residual_history; // residual after 0, 1, 2... iterations, if recording
+
+   PCGSolveStats(void)
+      : n(0), nonzeros(0), iterations(0), initial_residual(0), final_residual(0),
+        factor_seconds(0), iteration_seconds(0), converged(false)
+   {}
+};
+
 //============================================================================
 // Encapsulates the Conjugate Gradient algorithm with incomplete Cholesky
-// factorization preconditioner.
+// factorization preconditioner (or a user-supplied Preconditioner).
+//
+// In mixed-precision mode the matrix copy, MIC(0) factor and search
+// directions are stored as float, while the solution, residual and every
+// reduction stay in T; with refinement steps enabled, the true residual is
+// recomputed with the full-precision matrix once the float iteration has
+// converged, and the iteration is restarted from it if needed.
+//
+// The single-reduction option runs the Chronopoulos-Gear form of PCG instead:
+// both inner products and the residual norm come out of one combined
+// reduction, fused into the matrix-vector multiply, so each iteration has one
+// synchronization point instead of three. It converges the same in exact
+// arithmetic, at the price of two more vectors and a one-iteration delay in
+// noticing convergence.
+//
+// The MIC(0) factor can be kept across solves: while the matrix keeps the same
+// structure (structure stamp), the factor of an earlier matrix is reused for
+// up to a given number of solves, or until a solve needs noticeably more
+// iterations than the one that formed the factor, whichever comes first.
+//
+// The matrix-vector multiplies of CSR solves can run on a copy of the matrix
+// in another format instead: sliced ELLPACK (sliced_ell.h) or lower-triangle
+// symmetric storage (symmetric_matrix.h). The preconditioner is still formed
+// from the CSR matrix.
+//
+// Every solve leaves a PCGSolveStats behind; recording the residual of each
+// iteration as well is optional, since it costs an allocation per solve.
+
+enum MatrixFormat {
+   MATRIX_FORMAT_CSR,
+   MATRIX_FORMAT_SLICED_ELL,
+   MATRIX_FORMAT_SYMMETRIC
+};
 
 template <class T>
 struct PCGSolver
 {
    PCGSolver(void)
+      :
+#ifdef _OPENMP
+        level_scheduled_solves(true),
+#else
+        level_scheduled_solves(false),
+#endif
+        preconditioner(0), mixed_precision(false), refinement_steps(1), single_reduction(false), matrix_format(MATRIX_FORMAT_CSR),
+        max_reuse(0), iteration_growth(1.5), reuse_count(0), factor_iterations(0), formed_factor(false), refactor_requested(false),
+        record_residual_history(false)
    {
       set_solver_parameters(1e-5, 100, 0.97, 0.25);
    }
 
+   // Reuse the MIC(0) factor for up to max_reuse_ further solves of matrices
+   // with the same structure, refactoring early once a solve takes more than
+   // iteration_growth_ times the iterations of the solve that formed it.
+   // max_reuse_=0 refactors every solve.
+   void set_preconditioner_reuse(int max_reuse_, double iteration_growth_=1.5)
+   {
+      max_reuse=max_reuse_;
+      iteration_growth=iteration_growth_;
+   }
+
+   const PreconditionerReuseStats &get_reuse_stats(void) const { return reuse_stats; }
+   void reset_reuse_stats(void) { reuse_stats=PreconditionerReuseStats(); }
+
+   // keep the residual of every iteration in the solve stats
+   void set_residual_history(bool record_residual_history_)
+   {
+      record_residual_history=record_residual_history_;
+   }
+
+   const PCGSolveStats &get_last_solve_stats(void) const { return last_solve; }
+
+   // use the single-reduction (Chronopoulos-Gear) iteration
+   void set_single_reduction(bool single_reduction_)
+   {
+      single_reduction=single_reduction_;
+   }
+
+   // the format the multiplies of CSR solves use (mixed precision always
+   // multiplies with its float CSR copy); sort_window is that of sliced ELLPACK
+   void set_matrix_format(MatrixFormat matrix_format_, unsigned int sort_window=1)
+   {
+      matrix_format=matrix_format_;
+      if(sort_window!=sliced_matrix.sort_window){
+         sliced_matrix.sort_window=sort_window;
+         sliced_matrix.structure_stamp=0; // rebuild with the new ordering
+      }
+   }
+
+   // float storage with T accumulation for CSR solves with the built-in MIC(0)
+   // preconditioner; ignored with a user-supplied Preconditioner
+   void set_mixed_precision(bool mixed_precision_, int refinement_steps_=1)
+   {
+      mixed_precision=mixed_precision_;
+      refinement_steps=refinement_steps_;
+   }
+
+   // run the MIC(0) triangular solves level by level across threads (bit-identical results)
+   void set_level_scheduled_solves(bool level_scheduled_solves_)
+   {
+      level_scheduled_solves=level_scheduled_solves_;
+   }
+
+   // use the given preconditioner instead of MIC(0); pass null to go back to MIC(0).
+   // The solver does not take ownership.
+   void set_preconditioner(Preconditioner<T> *preconditioner_)
+   {
+      preconditioner=preconditioner_;
+   }
+
    void set_solver_parameters(T tolerance_factor_, int max_iterations_, T modified_incomplete_cholesky_parameter_=0.97, T min_diagonal_ratio_=0.25)
    {
       tolerance_factor=tolerance_factor_;
@@ -240,20 +594,97 @@ struct PCGSolver
       min_diagonal_ratio=min_diagonal_ratio_;
    }
 
-   bool solve(const SparseMatrix<T> &matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out) 
+   // If use_initial_guess is set, result must hold a starting guess x0 (of the
+   // right size) and the iteration begins from the residual rhs-matrix*x0;
+   // otherwise it starts from zero. Convergence is always measured against the
+   // infinity-norm of rhs, so a good guess saves iterations without loosening
+   // the tolerance.
+   bool solve(const SparseMatrix<T> &matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out,
+              bool use_initial_guess=false) 
+   {
+      fixed_matrix.construct_from_matrix(matrix);
+      return solve(fixed_matrix, rhs, result, residual_out, iterations_out, use_initial_guess);
+   }
+
+   // as above, for a matrix already in fixed (CSR) form, e.g. from a SparseMatrixBuilder
+   bool solve(const FixedSparseMatrix<T> &matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out,
+              bool use_initial_guess=false) 
+   {
+      std::chrono::steady_clock::time_point start=begin_stats(matrix.n, matrix.rowstart.empty() ? 0 : matrix.rowstart.back());
+      formed_factor=false;
+      bool success;
+      if(mixed_precision && !preconditioner)
+         success=solve_mixed(matrix, rhs, result, residual_out, iterations_out, use_initial_guess);
+      else if(matrix_format==MATRIX_FORMAT_SLICED_ELL){
+         sliced_matrix.construct_from_matrix(matrix);
+         success=solve_system(sliced_matrix, matrix, rhs, result, residual_out, iterations_out, use_initial_guess);
+      }else if(matrix_format==MATRIX_FORMAT_SYMMETRIC){
+         symmetric_matrix.construct_from_matrix(matrix);
+         success=solve_system(symmetric_matrix, matrix, rhs, result, residual_out, iterations_out, use_initial_guess);
+      }else
+         success=solve_system(matrix, matrix, rhs, result, residual_out, iterations_out, use_initial_guess);
+      end_stats(start, success, residual_out, iterations_out);
+      if(!preconditioner){
+         if(formed_factor)
+            factor_iterations=iterations_out;
+         else if(reuse_count>0 && iterations_out>iteration_growth*std::max(factor_iterations, 1))
+            refactor_requested=true; // the stale factor has degraded: refactor next time
+      }
+      return success;
+   }
+
+   // Matrix-free variant for any operator with a multiply(matrix, x, result)
+   // overload, e.g. StructuredGridMatrix. There is no CSR matrix to factor, so a
+   // Preconditioner must have been set and already formed for this operator.
+   template<class OperatorT>
+   bool solve_operator(const OperatorT &matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out,
+                       bool use_initial_guess=false) 
+   {
+      assert(preconditioner);
+      std::chrono::steady_clock::time_point start=begin_stats(matrix.n, 0);
+      bool success=solve_system(matrix, matrix, rhs, result, residual_out, iterations_out, use_initial_guess);
+      end_stats(start, success, residual_out, iterations_out);
+      return success;
+   }
+
+   protected:
+
+   // multiplies with matrix, forms the preconditioner from form_matrix (the
+   // same system in CSR form, or the operator itself when matrix-free)
+   template<class MatrixT, class FormMatrixT>
+   bool solve_system(const MatrixT &matrix, const FormMatrixT &form_matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out,
+                     bool use_initial_guess) 
    {
       unsigned int n=matrix.n;
       if(m.size()!=n){ m.resize(n); s.resize(n); z.resize(n); r.resize(n); }
-      zero(result);
       r=rhs;
       residual_out=BLAS::abs_max(r);
       if(residual_out==0) {
+         zero(result);
          iterations_out=0;
+         initial_residual(0);
          return true;
       }
       double tol=tolerance_factor*residual_out;
+      if(use_initial_guess && result.size()==n){
+         multiply(matrix, result, z);
+         residual_out=BLAS::add_scaled_abs_max(T(-1), z, r); // r=rhs-matrix*result
+         initial_residual(residual_out);
+         if(residual_out<=tol) {
+            iterations_out=0;
+            return true;
+         }
+      }else{
+         result.resize(n);
+         zero(result);
+         initial_residual(residual_out);
+      }
 
-      form_preconditioner(matrix);
+      std::chrono::steady_clock::time_point factor_start=std::chrono::steady_clock::now();
+      form_preconditioner(form_matrix);
+      last_solve.factor_seconds=seconds_since(factor_start);
+      if(single_reduction)
+         return single_reduction_iterations(matrix, result, tol, residual_out, iterations_out);
       apply_preconditioner(r, z);
       double rho=BLAS::dot(z, r);
       if(rho==0 || rho!=rho) {
@@ -262,14 +693,11 @@ struct PCGSolver
       }
 
       s=z;
-      fixed_matrix.construct_from_matrix(matrix);
       int iteration;
       for(iteration=0; iteration<max_iterations; ++iteration){
-         multiply(fixed_matrix, s, z);
-         double alpha=rho/BLAS::dot(s, z);
-         BLAS::add_scaled(alpha, s, result);
-         BLAS::add_scaled(-alpha, z, r);
-         residual_out=BLAS::abs_max(r);
+         double alpha=rho/multiply_dot(matrix, s, z); // z=matrix*s
+         residual_out=BLAS::add_scaled_pair_abs_max(alpha, s, result, -alpha, z, r);
+         record_residual(residual_out);
          if(residual_out<=tol) {
             iterations_out=iteration+1;
             return true; 
@@ -277,19 +705,149 @@ struct PCGSolver
          apply_preconditioner(r, z);
          double rho_new=BLAS::dot(z, r);
          double beta=rho_new/rho;
-         BLAS::add_scaled(beta, s, z); s.swap(z); // s=beta*s+z
+         BLAS::scale_and_add(beta, z, s); // s=beta*s+z
          rho=rho_new;
       }
       iterations_out=iteration;
       return false;
    }
 
-   protected:
+   // Chronopoulos-Gear PCG from the residual in r: with u=M^{-1}r and w=A*u
+   // (held in z and m), the search direction p and q=A*p (s and q) follow by
+   // recurrences, and (r,u), (w,u) and |r| are reduced together.
+   template<class MatrixT>
+   bool single_reduction_iterations(const MatrixT &matrix, std::vector<T> &result, double tol, T &residual_out, int &iterations_out)
+   {
+      unsigned int n=matrix.n;
+      q.resize(n);
+      zero(s);
+      zero(q);
+      apply_preconditioner(r, z);
+      double gamma, delta, r_max;
+      multiply_dots(matrix, z, m, r, gamma, delta, r_max);
+      if(gamma==0 || gamma!=gamma || delta==0) {
+         iterations_out=0;
+         return false;
+      }
+      double alpha=gamma/delta, beta=0;
+      int iteration;
+      for(iteration=0; iteration<max_iterations; ++iteration){
+         chronopoulos_gear_update(alpha, beta, z, m, s, q, result, r);
+         apply_preconditioner(r, z);
+         double gamma_new;
+         multiply_dots(matrix, z, m, r, gamma_new, delta, r_max);
+         residual_out=(T)r_max;
+         record_residual(residual_out);
+         if(residual_out<=tol) {
+            iterations_out=iteration+1;
+            return true;
+         }
+         beta=gamma_new/gamma;
+         alpha=gamma_new/(delta-beta*gamma_new/alpha);
+         gamma=gamma_new;
+      }
+      iterations_out=iteration;
+      return false;
+   }
+
+   bool solve_mixed(const FixedSparseMatrix<T> &matrix, const std::vector<T> &rhs, std::vector<T> &result, T &residual_out, int &iterations_out,
+                    bool use_initial_guess)
+   {
+      unsigned int n=matrix.n;
+      if(m.size()!=n){ m.resize(n); s.resize(n); z.resize(n); r.resize(n); }
+      if(float_s.size()!=n){ float_s.resize(n); float_z.resize(n); }
+      r=rhs;
+      residual_out=BLAS::abs_max(r);
+      iterations_out=0;
+      if(residual_out==0) {
+         zero(result);
+         initial_residual(0);
+         return true;
+      }
+      double tol=tolerance_factor*residual_out;
+      if(use_initial_guess && result.size()==n){
+         multiply(matrix, result, z);
+         residual_out=BLAS::add_scaled_abs_max(T(-1), z, r); // r=rhs-matrix*result
+         initial_residual(residual_out);
+         if(residual_out<=tol) return true;
+      }else{
+         result.resize(n);
+         zero(result);
+         initial_residual(residual_out);
+      }
+
+      std::chrono::steady_clock::time_point factor_start=std::chrono::steady_clock::now();
+      float_matrix.construct_converted(matrix);
+      if(!reuse_factor(matrix, float_factor.structure_stamp, float_factor.n)){
+         std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+         factor_modified_incomplete_cholesky0(float_matrix, float_factor, (float)modified_incomplete_cholesky_parameter, (float)min_diagonal_ratio);
+         factored(start);
+      }
+      // also after a reuse, in case scheduled solves were switched on since the
+      // factor was built (a no-op while the schedule matches its structure)
+      if(level_scheduled_solves) float_schedule.analyze(float_factor);
+      last_solve.factor_seconds=seconds_since(factor_start);
+
+      for(int refinement=0; ; ++refinement){
+         // float PCG on the current residual, updating result and r in T
+         apply_float_preconditioner(r, float_z);
+         double rho=BLAS::dot(float_z, r);
+         if(rho==0 || rho!=rho) return false;
+         float_s=float_z;
+         bool converged=false;
+         while(iterations_out<max_iterations){
+            double alpha=rho/multiply_dot(float_matrix, float_s, float_z); // float_z=matrix*float_s
+            residual_out=BLAS::add_scaled_pair_abs_max(alpha, float_s, result, -alpha, float_z, r);
+            ++iterations_out;
+            record_residual(residual_out);
+            if(residual_out<=tol) {
+               converged=true;
+               break;
+            }
+            apply_float_preconditioner(r, float_z);
+            double rho_new=BLAS::dot(float_z, r);
+            double beta=rho_new/rho;
+            BLAS::scale_and_add(beta, float_z, float_s); // s=beta*s+z
+            rho=rho_new;
+         }
+         if(!converged || refinement>=refinement_steps) return converged;
+
+         // refinement: replace the recursively updated residual by the true one
+         r=rhs;
+         multiply(matrix, result, z);
+         residual_out=BLAS::add_scaled_abs_max(T(-1), z, r);
+         if(residual_out<=tol) return true;
+      }
+   }
 
    // internal structures
    SparseColumnLowerFactor<T> ic_factor; // modified incomplete cholesky factor
+   SparseColumnLowerSchedule<T> ic_schedule; // level schedule for ic_factor's triangular solves
+   bool level_scheduled_solves;
    std::vector<T> m, z, s, r; // temporary vectors for PCG
-   FixedSparseMatrix<T> fixed_matrix; // used within loop
+   std::vector<T> q; // matrix times the search direction, for single-reduction PCG
+   FixedSparseMatrix<T> fixed_matrix; // fixed copy of a dynamic SparseMatrix
+   Preconditioner<T> *preconditioner; // if non-null, used instead of ic_factor
+   bool mixed_precision;
+   int refinement_steps; // full-precision residual corrections allowed in mixed-precision mode
+   bool single_reduction;
+   MatrixFormat matrix_format;
+   SlicedEllMatrix<T> sliced_matrix; // copies of the CSR matrix for the multiplies, in the other formats
+   SymmetricSparseMatrix<T> symmetric_matrix;
+   // stale-preconditioner policy
+   int max_reuse; // solves a factor may be reused for
+   double iteration_growth; // refactor once iterations exceed this multiple of the fresh factor's
+   int reuse_count; // solves since the factor was formed
+   int factor_iterations; // iterations of the solve that formed the factor
+   bool formed_factor; // the current solve formed a new factor
+   bool refactor_requested;
+   PreconditionerReuseStats reuse_stats;
+   bool record_residual_history;
+   PCGSolveStats last_solve;
+   FixedSparseMatrix<float> float_matrix; // float copies for mixed precision
+   SparseColumnLowerFactor<float> float_factor;
+   SparseColumnLowerSchedule<float> float_schedule;
+   std::vector<float> float_s, float_z;
 
    // parameters
    T tolerance_factor;
@@ -297,16 +855,105 @@ struct PCGSolver
    T modified_incomplete_cholesky_parameter;
    T min_diagonal_ratio;
 
-   void form_preconditioner(const SparseMatrix<T>& matrix)
+   void form_preconditioner(const FixedSparseMatrix<T>& matrix)
+   {
+      if(preconditioner)
+         preconditioner->form(matrix);
+      else if(!reuse_factor(matrix, ic_factor.structure_stamp, ic_factor.n)){
+         std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+         factor_modified_incomplete_cholesky0(matrix, ic_factor);
+         factored(start);
+      }
+      // also after a reuse, in case scheduled solves were switched on since the
+      // factor was built (a no-op while the schedule matches its structure)
+      if(level_scheduled_solves) ic_schedule.analyze(ic_factor);
+   }
+
+   // may the factor built for structure factor_stamp stand in for matrix's own?
+   bool reuse_factor(const FixedSparseMatrix<T>& matrix, unsigned int factor_stamp, unsigned int factor_n)
+   {
+      if(max_reuse<=0 || refactor_requested || reuse_count>=max_reuse) return false;
+      if(factor_stamp==0 || factor_stamp!=matrix.structure_stamp || factor_n!=matrix.n) return false;
+      ++reuse_count;
+      ++reuse_stats.reuses;
+      if(reuse_stats.factorizations>0)
+         reuse_stats.saved_seconds+=reuse_stats.factor_seconds/reuse_stats.factorizations;
+      return true;
+   }
+
+   void factored(const std::chrono::steady_clock::time_point &start)
    {
-      factor_modified_incomplete_cholesky0(matrix, ic_factor);
+      formed_factor=true;
+      refactor_requested=false;
+      reuse_count=0;
+      ++reuse_stats.factorizations;
+      reuse_stats.factor_seconds+=seconds_since(start);
    }
 
+   static double seconds_since(const std::chrono::steady_clock::time_point &start)
+   {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+   }
+
+   // solve stats bookkeeping
+   std::chrono::steady_clock::time_point begin_stats(unsigned int n, unsigned int nonzeros)
+   {
+      last_solve.n=n;
+      last_solve.nonzeros=nonzeros;
+      last_solve.factor_seconds=0;
+      last_solve.residual_history.clear();
+      return std::chrono::steady_clock::now();
+   }
+
+   void initial_residual(double residual)
+   {
+      last_solve.initial_residual=residual;
+      record_residual(residual);
+   }
+
+   void record_residual(double residual)
+   {
+      if(record_residual_history) last_solve.residual_history.push_back(residual);
+   }
+
+   void end_stats(const std::chrono::steady_clock::time_point &start, bool success, double residual, int iterations)
+   {
+      last_solve.iterations=iterations;
+      last_solve.final_residual=residual;
+      last_solve.converged=success;
+      last_solve.iteration_seconds=std::max(seconds_since(start)-last_solve.factor_seconds, 0.0);
+   }
+
+   // matrix-free operators: the caller forms the preconditioner
+   template<class OperatorT>
+   void form_preconditioner(const OperatorT&)
+   {}
+
    void apply_preconditioner(const std::vector<T> &x, std::vector<T> &result)
    {
+      if(preconditioner){
+         preconditioner->apply(x, result);
+         return;
+      }
+      if(level_scheduled_solves){
+         solve_lower_scheduled(ic_factor, ic_schedule, x, result);
+         solve_lower_transpose_in_place_scheduled(ic_factor, ic_schedule, result);
+         return;
+      }
       solve_lower(ic_factor, x, result);
       solve_lower_transpose_in_place(ic_factor,result);
    }
+
+   void apply_float_preconditioner(const std::vector<T> &x, std::vector<float> &result)
+   {
+      if(level_scheduled_solves){
+         solve_lower_scheduled(float_factor, float_schedule, x, result);
+         solve_lower_transpose_in_place_scheduled(float_factor, float_schedule, result);
+         return;
+      }
+      solve_lower(float_factor, x, result);
+      solve_lower_transpose_in_place(float_factor, result);
+   }
 };
 
 #endif
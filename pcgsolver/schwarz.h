@@ -0,0 +1,216 @@
+#ifndef SCHWARZ_H
+#define SCHWARZ_H
+
+// Additive Schwarz (block Jacobi when there is no overlap) preconditioner with
+// a MIC(0) factor per subdomain, as a parallel alternative to the global
+// MIC(0) of PCGSolver, whose factorization and triangular solves are
+// inherently sequential.
+//
+// The unknowns are split into one subdomain per thread (or a given count) by
+// cutting a breadth-first ordering of the matrix graph into equal pieces, which
+// gives compact strips whatever the numbering. Each subdomain can be grown by
+// a number of layers of neighbours (overlap). The subdomain matrices are
+// factored, and their solves applied, independently and in parallel; the
+// subdomain solutions are then summed, which keeps the preconditioner
+// symmetric as PCG requires.
+//
+// Dropping the couplings between subdomains costs some iterations, more with
+// more subdomains; overlap wins some of them back. A single subdomain is
+// exactly the global MIC(0).
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include "pcg_solver.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+template<class T>
+struct SchwarzSubdomain
+{
+   std::vector<unsigned int> unknowns; // global unknowns, ascending
+   FixedSparseMatrix<T> matrix; // the block of the global matrix they span
+   std::vector<unsigned int> source; // where each entry of matrix sits in the global matrix
+   SparseColumnLowerFactor<T> factor;
+   std::vector<T> x, y; // local right-hand side and solution
+};
+
+template<class T>
+struct AdditiveSchwarzPreconditioner : public Preconditioner<T>
+{
+   // parameters
+   int subdomain_count; // 0: one per OpenMP thread
+   int overlap; // layers of neighbours added to each subdomain (0: block Jacobi)
+   T modification_parameter;
+   T min_diagonal_ratio;
+
+   std::vector<SchwarzSubdomain<T> > subdomains;
+
+   AdditiveSchwarzPreconditioner(void)
+      : subdomain_count(0), overlap(1), modification_parameter(0.97f), min_diagonal_ratio(0.25f),
+        structure_stamp(0), n(0), built_count(0), built_overlap(0)
+   {}
+
+   void form(const FixedSparseMatrix<T> &matrix)
+   {
+      int count=subdomain_count;
+#ifdef _OPENMP
+      if(count<=0) count=omp_get_max_threads();
+#endif
+      if(count<=0) count=1;
+      if(matrix.structure_stamp==0 || matrix.structure_stamp!=structure_stamp || matrix.n!=n
+         || count!=built_count || overlap!=built_overlap)
+         partition(matrix, count);
+
+      int blocks=(int)subdomains.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for(int b=0; b<blocks; ++b){
+         SchwarzSubdomain<T> &domain=subdomains[b];
+         for(unsigned int p=0; p<domain.source.size(); ++p)
+            domain.matrix.value[p]=matrix.value[domain.source[p]];
+         factor_modified_incomplete_cholesky0(domain.matrix, domain.factor, modification_parameter, min_diagonal_ratio);
+      }
+   }
+
+   void apply(const std::vector<T> &x, std::vector<T> &result)
+   {
+      assert(x.size()==n);
+      int blocks=(int)subdomains.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+      for(int b=0; b<blocks; ++b){
+         SchwarzSubdomain<T> &domain=subdomains[b];
+         for(unsigned int k=0; k<domain.unknowns.size(); ++k)
+            domain.x[k]=x[domain.unknowns[k]];
+         solve_lower(domain.factor, domain.x, domain.y);
+         solve_lower_transpose_in_place(domain.factor, domain.y);
+      }
+      // sum the subdomain solutions, unknown by unknown
+      result.resize(n);
+      int size=(int)n;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(size>=(int)BLAS::MIN_PARALLEL_SIZE)
+#endif
+      for(int i=0; i<size; ++i){
+         T sum=0;
+         for(unsigned int p=contribution_start[i]; p<contribution_start[i+1]; ++p)
+            sum+=subdomains[contribution_domain[p]].y[contribution_index[p]];
+         result[i]=sum;
+      }
+   }
+
+   protected:
+
+   unsigned int structure_stamp; // matrix structure the subdomains were built for
+   unsigned int n;
+   int built_count, built_overlap;
+   // the subdomain entries making up each global unknown, for the sum in apply
+   std::vector<unsigned int> contribution_start, contribution_domain, contribution_index;
+
+   void partition(const FixedSparseMatrix<T> &matrix, int count)
+   {
+      n=matrix.n;
+      structure_stamp=matrix.structure_stamp;
+      built_count=count;
+      built_overlap=overlap;
+
+      // breadth-first ordering, one connected component after another
+      std::vector<unsigned int> order;
+      order.reserve(n);
+      std::vector<char> visited(n, 0);
+      for(unsigned int seed=0; seed<n; ++seed){
+         if(visited[seed]) continue;
+         visited[seed]=1;
+         order.push_back(seed);
+         for(unsigned int head=(unsigned int)order.size()-1; head<order.size(); ++head){
+            unsigned int i=order[head];
+            for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p){
+               unsigned int j=matrix.colindex[p];
+               if(!visited[j]){
+                  visited[j]=1;
+                  order.push_back(j);
+               }
+            }
+         }
+      }
+
+      // equal pieces of it, grown by the overlap
+      if(count>(int)n) count=(n>0 ? (int)n : 1);
+      subdomains.clear();
+      subdomains.resize(count);
+      std::vector<int> mark(n, -1);
+      for(int b=0; b<count; ++b){
+         unsigned int begin=(unsigned int)((unsigned long long)n*b/count), end=(unsigned int)((unsigned long long)n*(b+1)/count);
+         std::vector<unsigned int> &unknowns=subdomains[b].unknowns;
+         for(unsigned int k=begin; k<end; ++k){
+            mark[order[k]]=b;
+            unknowns.push_back(order[k]);
+         }
+         for(int layer=0, layer_begin=0; layer<overlap; ++layer){
+            int layer_end=(int)unknowns.size();
+            for(int k=layer_begin; k<layer_end; ++k){
+               unsigned int i=unknowns[k];
+               for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p){
+                  unsigned int j=matrix.colindex[p];
+                  if(mark[j]!=b){
+                     mark[j]=b;
+                     unknowns.push_back(j);
+                  }
+               }
+            }
+            layer_begin=layer_end;
+         }
+         std::sort(unknowns.begin(), unknowns.end()); // keep the global elimination order within the block
+      }
+
+      // the subdomain matrices, remembering where their entries come from
+      std::vector<int> local(n, -1);
+      contribution_start.assign(n+1, 0);
+      for(int b=0; b<count; ++b){
+         SchwarzSubdomain<T> &domain=subdomains[b];
+         unsigned int size=(unsigned int)domain.unknowns.size();
+         for(unsigned int k=0; k<size; ++k){
+            local[domain.unknowns[k]]=(int)k;
+            ++contribution_start[domain.unknowns[k]+1];
+         }
+         FixedSparseMatrix<T> &block=domain.matrix;
+         block.resize(size);
+         block.structure_stamp=new_structure_stamp();
+         block.colindex.clear();
+         domain.source.clear();
+         block.rowstart[0]=0;
+         for(unsigned int k=0; k<size; ++k){
+            unsigned int i=domain.unknowns[k];
+            for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p){
+               if(local[matrix.colindex[p]]>=0){
+                  block.colindex.push_back((unsigned int)local[matrix.colindex[p]]);
+                  domain.source.push_back(p);
+               }
+            }
+            block.rowstart[k+1]=(unsigned int)block.colindex.size();
+         }
+         block.value.resize(block.colindex.size());
+         domain.x.resize(size);
+         domain.y.resize(size);
+         domain.factor.clear();
+         for(unsigned int k=0; k<size; ++k) local[domain.unknowns[k]]=-1;
+      }
+      for(unsigned int i=0; i<n; ++i) contribution_start[i+1]+=contribution_start[i];
+      contribution_domain.resize(contribution_start[n]);
+      contribution_index.resize(contribution_start[n]);
+      std::vector<unsigned int> fill(contribution_start.begin(), contribution_start.end()-1);
+      for(int b=0; b<count; ++b){
+         for(unsigned int k=0; k<subdomains[b].unknowns.size(); ++k){
+            unsigned int q=fill[subdomains[b].unknowns[k]]++;
+            contribution_domain[q]=(unsigned int)b;
+            contribution_index[q]=k;
+         }
+      }
+   }
+};
+
+#endif
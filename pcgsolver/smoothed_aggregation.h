@@ -0,0 +1,569 @@
+#ifndef SMOOTHED_AGGREGATION_H
+#define SMOOTHED_AGGREGATION_H
+
+// Smoothed aggregation algebraic multigrid (Vanek, Mandel & Brezina) as a
+// preconditioner for PCGSolver, built from the assembled matrix alone. It is
+// meant for systems without the regular 5-point structure MultigridPreconditioner
+// relies on, such as the coupled u/v viscosity system.
+//
+// Each level is set up as follows:
+//  - strength of connection: i and j are strongly coupled if
+//    |a_ij| >= theta*sqrt(a_ii*a_jj), with theta halving on every coarser level;
+//  - aggregation: greedy, in the usual three passes (whole strong
+//    neighbourhoods first, then leftovers join a neighbouring aggregate, then
+//    what is left forms aggregates of its own). Unknowns with no strong
+//    couplings at all are left to the smoother;
+//  - tentative prolongator: the near-nullspace vectors restricted to each
+//    aggregate and orthonormalized (per-aggregate QR), so the coarse space
+//    reproduces them exactly. The R factors become the coarse near-nullspace,
+//    and the coarse unknowns of one aggregate are aggregated together below;
+//  - smoothed prolongator P=(I-omega*D^{-1}*A)*P_tent, with
+//    omega=(4/3)/rho(D^{-1}*A) and rho from a few power iterations;
+//  - Galerkin coarse matrix P^T*A*P.
+// For the viscosity system the near-nullspace is the rigid body motions (two
+// translations and a rotation), which set_near_nullspace supplies; without it
+// the constant vector is used, as for a scalar problem.
+//
+// The cycle is a V-cycle with forward Gauss-Seidel before and backward
+// Gauss-Seidel after each coarse correction, so it is symmetric as PCG
+// requires, and a sparse Cholesky solve on the coarsest level.
+//
+// While the matrix keeps its structure stamp, form() keeps the aggregates, the
+// tentative prolongators, the damping factors and the sparsity of every P, R
+// and coarse matrix, and only recomputes their values. The coarse matrices
+// keep their stamps too, so the coarsest Cholesky factor keeps its analysis.
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include "pcg_solver.h"
+#include "sparse_cholesky.h"
+
+//============================================================================
+// Sparse products for building the hierarchy. The operands are CSR matrices
+// stored in FixedSparseMatrix, whose n is taken as the row count only, so
+// rectangular transfer operators fit too. The structure of each result depends
+// only on those of the operands, so the _values variants refill a result built
+// earlier from operands of the same structure, summing in the same order.
+
+// result=transpose of matrix, which has the given number of columns
+template<class T>
+void sparse_transpose(const FixedSparseMatrix<T> &matrix, unsigned int columns, FixedSparseMatrix<T> &result)
+{
+   result.resize(columns);
+   result.structure_stamp=new_structure_stamp();
+   std::fill(result.rowstart.begin(), result.rowstart.end(), 0);
+   unsigned int nnz=matrix.rowstart[matrix.n];
+   for(unsigned int p=0; p<nnz; ++p) ++result.rowstart[matrix.colindex[p]+1];
+   for(unsigned int j=0; j<columns; ++j) result.rowstart[j+1]+=result.rowstart[j];
+   result.colindex.resize(nnz);
+   result.value.resize(nnz);
+   std::vector<unsigned int> fill(result.rowstart.begin(), result.rowstart.end()-1);
+   for(unsigned int i=0; i<matrix.n; ++i){
+      for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p){
+         unsigned int q=fill[matrix.colindex[p]]++;
+         result.colindex[q]=i;
+         result.value[q]=matrix.value[p];
+      }
+   }
+}
+
+// result=a*b, where b has the given number of columns (rows come out sorted)
+template<class T>
+void sparse_product(const FixedSparseMatrix<T> &a, const FixedSparseMatrix<T> &b, unsigned int columns, FixedSparseMatrix<T> &result)
+{
+   result.resize(a.n);
+   result.structure_stamp=new_structure_stamp();
+   result.colindex.clear();
+   result.value.clear();
+   std::vector<T> sum(columns, 0); // dense accumulator for the current row
+   std::vector<bool> used(columns, false);
+   std::vector<unsigned int> row; // its columns
+   result.rowstart[0]=0;
+   for(unsigned int i=0; i<a.n; ++i){
+      row.clear();
+      for(unsigned int p=a.rowstart[i]; p<a.rowstart[i+1]; ++p){
+         unsigned int k=a.colindex[p];
+         T a_ik=a.value[p];
+         for(unsigned int q=b.rowstart[k]; q<b.rowstart[k+1]; ++q){
+            unsigned int j=b.colindex[q];
+            if(!used[j]){
+               used[j]=true;
+               row.push_back(j);
+            }
+            sum[j]+=a_ik*b.value[q];
+         }
+      }
+      std::sort(row.begin(), row.end());
+      for(unsigned int r=0; r<row.size(); ++r){
+         unsigned int j=row[r];
+         result.colindex.push_back(j);
+         result.value.push_back(sum[j]);
+         sum[j]=0;
+         used[j]=false;
+      }
+      result.rowstart[i+1]=(unsigned int)result.colindex.size();
+   }
+}
+
+// values of result=transpose of matrix, into the structure sparse_transpose gave
+template<class T>
+void sparse_transpose_values(const FixedSparseMatrix<T> &matrix, FixedSparseMatrix<T> &result)
+{
+   std::vector<unsigned int> fill(result.rowstart.begin(), result.rowstart.end()-1);
+   for(unsigned int i=0; i<matrix.n; ++i)
+      for(unsigned int p=matrix.rowstart[i]; p<matrix.rowstart[i+1]; ++p)
+         result.value[fill[matrix.colindex[p]]++]=matrix.value[p];
+}
+
+// values of result=a*b, into the structure sparse_product gave
+template<class T>
+void sparse_product_values(const FixedSparseMatrix<T> &a, const FixedSparseMatrix<T> &b, unsigned int columns, FixedSparseMatrix<T> &result)
+{
+   assert(result.n==a.n);
+   std::vector<T> sum(columns, 0);
+   for(unsigned int i=0; i<a.n; ++i){
+      for(unsigned int p=a.rowstart[i]; p<a.rowstart[i+1]; ++p){
+         unsigned int k=a.colindex[p];
+         T a_ik=a.value[p];
+         for(unsigned int q=b.rowstart[k]; q<b.rowstart[k+1]; ++q) sum[b.colindex[q]]+=a_ik*b.value[q];
+      }
+      for(unsigned int p=result.rowstart[i]; p<result.rowstart[i+1]; ++p){
+         result.value[p]=sum[result.colindex[p]];
+         sum[result.colindex[p]]=0;
+      }
+   }
+}
+
+//============================================================================
+
+template<class T>
+struct SmoothedAggregationLevel
+{
+   FixedSparseMatrix<T> A;
+   FixedSparseMatrix<T> P; // prolongator from the next coarser level (empty on the coarsest)
+   FixedSparseMatrix<T> R; // its transpose, the restriction
+   FixedSparseMatrix<T> tentative; // tentative prolongator P_tent, kept with the structure
+   FixedSparseMatrix<T> smoothing; // -omega*D^{-1}*A*P_tent
+   FixedSparseMatrix<T> AP; // A*P, the first half of the Galerkin product
+   T omega; // prolongator damping over rho(D^{-1}A), kept with the structure
+   std::vector<T> invdiag;
+   std::vector<T> x, b, r; // solution, right-hand side and residual
+};
+
+template<class T>
+struct SmoothedAggregationPreconditioner : public Preconditioner<T>
+{
+   // parameters
+   T strength_threshold; // theta on the finest level
+   T prolongator_damping; // omega*rho(D^{-1}A)
+   int pre_sweeps, post_sweeps; // Gauss-Seidel sweeps around each coarse correction
+   unsigned int max_coarse_size; // stop coarsening once a level is this small...
+   unsigned int max_levels; // ...or there are this many levels
+   T min_coarsening; // ...or a level keeps more than this fraction of the unknowns
+
+   std::vector<SmoothedAggregationLevel<T> > levels;
+
+   SmoothedAggregationPreconditioner(void)
+      : strength_threshold(0.08f), prolongator_damping(4/3.f), pre_sweeps(1), post_sweeps(1),
+        max_coarse_size(300), max_levels(12), min_coarsening(0.85f), mode_count(0), structure_stamp(0)
+   {}
+
+   // Near-nullspace vectors of the operator: mode m of unknown i is
+   // modes[i*count+m]. Pass count=0 to go back to the constant vector.
+   // The next form builds a new hierarchy.
+   void set_near_nullspace(const std::vector<T> &modes, unsigned int count)
+   {
+      near_nullspace=modes;
+      mode_count=count;
+      structure_stamp=0;
+   }
+
+   void form(const FixedSparseMatrix<T> &matrix)
+   {
+      if(matrix.structure_stamp!=0 && matrix.structure_stamp==structure_stamp && !levels.empty() && levels[0].A.n==matrix.n)
+         update_values(matrix);
+      else{
+         build(matrix);
+         structure_stamp=matrix.structure_stamp;
+      }
+      coarse_solver.factor(levels.back().A);
+   }
+
+   void apply(const std::vector<T> &x, std::vector<T> &result)
+   {
+      assert(!levels.empty() && x.size()==levels[0].A.n);
+      levels[0].b=x;
+      v_cycle(0);
+      result=levels[0].x;
+   }
+
+   // sum of the nonzeros of all levels over those of the finest
+   double operator_complexity(void) const
+   {
+      if(levels.empty() || levels[0].A.value.empty()) return 0;
+      double total=0;
+      for(unsigned int l=0; l<levels.size(); ++l) total+=levels[l].A.value.size();
+      return total/levels[0].A.value.size();
+   }
+
+   protected:
+
+   std::vector<T> near_nullspace;
+   unsigned int mode_count;
+   SparseCholesky<T> coarse_solver;
+   unsigned int structure_stamp; // of the matrix the hierarchy was built for (0 if none)
+
+   // aggregate and build the whole hierarchy for matrix
+   void build(const FixedSparseMatrix<T> &matrix)
+   {
+      levels.resize(1);
+      levels[0].A=matrix;
+      levels[0].A.builder_position.clear();
+
+      // finest level: every unknown is a node of its own
+      std::vector<unsigned int> node_start(matrix.n+1);
+      for(unsigned int i=0; i<=matrix.n; ++i) node_start[i]=i;
+      unsigned int k=mode_count;
+      std::vector<T> modes;
+      if(k>0 && near_nullspace.size()==(size_t)matrix.n*k)
+         modes=near_nullspace;
+      else{
+         k=1;
+         modes.assign(matrix.n, 1);
+      }
+
+      T theta=strength_threshold;
+      for(;;){
+         SmoothedAggregationLevel<T> &fine=levels.back();
+         prepare(fine);
+         unsigned int n=fine.A.n;
+         if(n<=max_coarse_size || levels.size()>=max_levels) break;
+
+         std::vector<int> aggregate;
+         unsigned int aggregate_count=aggregate_nodes(fine.A, node_start, theta, aggregate);
+         if(aggregate_count==0) break;
+
+         // tentative prolongator and coarse near-nullspace
+         FixedSparseMatrix<T> tentative;
+         std::vector<unsigned int> coarse_node_start;
+         std::vector<T> coarse_modes;
+         unsigned int coarse_n=tentative_prolongator(n, node_start, aggregate, aggregate_count, modes, k,
+                                                    tentative, coarse_node_start, coarse_modes);
+         if(coarse_n==0 || coarse_n>min_coarsening*n) break;
+
+         // smooth it: P=tentative-omega*D^{-1}*A*tentative
+         fine.tentative=tentative;
+         sparse_product(fine.A, fine.tentative, coarse_n, fine.smoothing);
+         fine.omega=prolongator_damping/spectral_radius(fine);
+         scale_smoothing(fine);
+         add_sparse(fine.smoothing, fine.tentative, coarse_n, fine.P);
+         sparse_transpose(fine.P, coarse_n, fine.R);
+
+         // Galerkin coarse matrix R*A*P
+         SmoothedAggregationLevel<T> coarse;
+         sparse_product(fine.A, fine.P, coarse_n, fine.AP);
+         sparse_product(fine.R, fine.AP, coarse_n, coarse.A);
+         levels.push_back(coarse);
+
+         node_start.swap(coarse_node_start);
+         modes.swap(coarse_modes);
+         theta*=0.5f;
+      }
+   }
+
+   // recompute the values of the hierarchy for a matrix with the structure it
+   // was built for, through the same products
+   void update_values(const FixedSparseMatrix<T> &matrix)
+   {
+      levels[0].A.value=matrix.value;
+      for(unsigned int l=0; l+1<levels.size(); ++l){
+         SmoothedAggregationLevel<T> &fine=levels[l], &coarse=levels[l+1];
+         prepare(fine);
+         unsigned int coarse_n=coarse.A.n;
+         sparse_product_values(fine.A, fine.tentative, coarse_n, fine.smoothing);
+         scale_smoothing(fine);
+         add_sparse_values(fine.smoothing, fine.tentative, coarse_n, fine.P);
+         sparse_transpose_values(fine.P, fine.R);
+         sparse_product_values(fine.A, fine.P, coarse_n, fine.AP);
+         sparse_product_values(fine.R, fine.AP, coarse_n, coarse.A);
+      }
+      prepare(levels.back());
+   }
+
+   // smoothing=A*P_tent becomes -omega*D^{-1}*A*P_tent
+   void scale_smoothing(SmoothedAggregationLevel<T> &level)
+   {
+      FixedSparseMatrix<T> &product=level.smoothing;
+      for(unsigned int i=0; i<product.n; ++i)
+         for(unsigned int p=product.rowstart[i]; p<product.rowstart[i+1]; ++p)
+            product.value[p]*=-level.omega*level.invdiag[i];
+   }
+
+   void prepare(SmoothedAggregationLevel<T> &level)
+   {
+      const FixedSparseMatrix<T> &A=level.A;
+      level.invdiag.assign(A.n, 0);
+      for(unsigned int i=0; i<A.n; ++i)
+         for(unsigned int p=A.rowstart[i]; p<A.rowstart[i+1]; ++p)
+            if(A.colindex[p]==i && A.value[p]!=0) level.invdiag[i]=1/A.value[p];
+      level.x.resize(A.n);
+      level.b.resize(A.n);
+      level.r.resize(A.n);
+   }
+
+   // Greedy aggregation of the nodes (groups of unknowns node_start[I] to
+   // node_start[I+1]-1) by strength of connection. Returns the number of
+   // aggregates; nodes left out of every aggregate get -1.
+   unsigned int aggregate_nodes(const FixedSparseMatrix<T> &A, const std::vector<unsigned int> &node_start, T theta,
+                                std::vector<int> &aggregate)
+   {
+      unsigned int nodes=(unsigned int)node_start.size()-1;
+      std::vector<unsigned int> node_of(A.n);
+      for(unsigned int I=0; I<nodes; ++I)
+         for(unsigned int i=node_start[I]; i<node_start[I+1]; ++i) node_of[i]=I;
+
+      // strong node graph, symmetric since A is
+      std::vector<unsigned int> strong_start(nodes+1, 0), strong;
+      std::vector<int> seen(nodes, -1);
+      for(unsigned int I=0; I<nodes; ++I){
+         for(unsigned int i=node_start[I]; i<node_start[I+1]; ++i){
+            T a_ii=std::fabs(diagonal(A, i));
+            for(unsigned int p=A.rowstart[i]; p<A.rowstart[i+1]; ++p){
+               unsigned int j=A.colindex[p], J=node_of[j];
+               if(J==I || seen[J]==(int)I) continue;
+               T a_jj=std::fabs(diagonal(A, j));
+               if(std::fabs(A.value[p])>=theta*std::sqrt(a_ii*a_jj)){
+                  seen[J]=(int)I;
+                  strong.push_back(J);
+               }
+            }
+         }
+         strong_start[I+1]=(unsigned int)strong.size();
+      }
+
+      aggregate.assign(nodes, -1);
+      int count=0;
+      // pass 1: nodes whose whole strong neighbourhood is still free
+      for(unsigned int I=0; I<nodes; ++I){
+         if(aggregate[I]>=0 || strong_start[I]==strong_start[I+1]) continue;
+         bool free=true;
+         for(unsigned int p=strong_start[I]; p<strong_start[I+1] && free; ++p)
+            free=(aggregate[strong[p]]<0);
+         if(!free) continue;
+         aggregate[I]=count;
+         for(unsigned int p=strong_start[I]; p<strong_start[I+1]; ++p) aggregate[strong[p]]=count;
+         ++count;
+      }
+      // pass 2: leftovers join a neighbouring aggregate from pass 1
+      std::vector<int> joined(aggregate);
+      for(unsigned int I=0; I<nodes; ++I){
+         if(aggregate[I]>=0) continue;
+         for(unsigned int p=strong_start[I]; p<strong_start[I+1]; ++p){
+            if(aggregate[strong[p]]>=0){
+               joined[I]=aggregate[strong[p]];
+               break;
+            }
+         }
+      }
+      aggregate.swap(joined);
+      // pass 3: whatever is still free (and strongly coupled) starts a new aggregate
+      for(unsigned int I=0; I<nodes; ++I){
+         if(aggregate[I]>=0 || strong_start[I]==strong_start[I+1]) continue;
+         aggregate[I]=count;
+         for(unsigned int p=strong_start[I]; p<strong_start[I+1]; ++p)
+            if(aggregate[strong[p]]<0) aggregate[strong[p]]=count;
+         ++count;
+      }
+      return (unsigned int)count;
+   }
+
+   // Orthonormalizes the k near-nullspace vectors over each aggregate
+   // (modified Gram-Schmidt, twice), dropping dependent ones. Returns the
+   // number of coarse unknowns.
+   unsigned int tentative_prolongator(unsigned int n, const std::vector<unsigned int> &node_start, const std::vector<int> &aggregate,
+                                      unsigned int aggregate_count, const std::vector<T> &modes, unsigned int k,
+                                      FixedSparseMatrix<T> &tentative, std::vector<unsigned int> &coarse_node_start,
+                                      std::vector<T> &coarse_modes)
+   {
+      // unknowns of each aggregate (counting sort)
+      unsigned int nodes=(unsigned int)node_start.size()-1;
+      std::vector<unsigned int> member_start(aggregate_count+1, 0), members;
+      for(unsigned int I=0; I<nodes; ++I)
+         if(aggregate[I]>=0) member_start[aggregate[I]+1]+=node_start[I+1]-node_start[I];
+      for(unsigned int a=0; a<aggregate_count; ++a) member_start[a+1]+=member_start[a];
+      members.resize(member_start[aggregate_count]);
+      std::vector<unsigned int> fill(member_start.begin(), member_start.end()-1);
+      for(unsigned int I=0; I<nodes; ++I)
+         if(aggregate[I]>=0)
+            for(unsigned int i=node_start[I]; i<node_start[I+1]; ++i) members[fill[aggregate[I]]++]=i;
+
+      // at most one coarse column of P_tent per row: position and value
+      std::vector<int> row_aggregate(n, -1);
+      std::vector<T> q; // orthonormal columns of the current aggregate
+      std::vector<std::vector<T> > column_values(n); // P_tent row entries, in coarse column order
+      std::vector<std::vector<unsigned int> > column_index(n);
+      coarse_node_start.assign(1, 0);
+      coarse_modes.clear();
+      unsigned int coarse_n=0;
+      for(unsigned int a=0; a<aggregate_count; ++a){
+         unsigned int size=member_start[a+1]-member_start[a];
+         const unsigned int *member=&members[member_start[a]];
+         q.clear();
+         unsigned int rank=0;
+         for(unsigned int m=0; m<k; ++m){
+            std::vector<T> column(size);
+            T original=0;
+            for(unsigned int r=0; r<size; ++r){
+               column[r]=modes[member[r]*k+m];
+               original+=column[r]*column[r];
+            }
+            for(int pass=0; pass<2; ++pass){
+               for(unsigned int c=0; c<rank; ++c){
+                  T d=0;
+                  for(unsigned int r=0; r<size; ++r) d+=q[c*size+r]*column[r];
+                  for(unsigned int r=0; r<size; ++r) column[r]-=d*q[c*size+r];
+               }
+            }
+            T norm=0;
+            for(unsigned int r=0; r<size; ++r) norm+=column[r]*column[r];
+            if(!(norm>1e-16*original)) continue;
+            norm=std::sqrt(norm);
+            for(unsigned int r=0; r<size; ++r) q.push_back(column[r]/norm);
+            ++rank;
+         }
+         for(unsigned int c=0; c<rank; ++c){
+            for(unsigned int r=0; r<size; ++r){
+               column_index[member[r]].push_back(coarse_n+c);
+               column_values[member[r]].push_back(q[c*size+r]);
+            }
+            // coarse near-nullspace: R=Q^T*B
+            for(unsigned int m=0; m<k; ++m){
+               T d=0;
+               for(unsigned int r=0; r<size; ++r) d+=q[c*size+r]*modes[member[r]*k+m];
+               coarse_modes.push_back(d);
+            }
+         }
+         if(rank==0) continue;
+         coarse_n+=rank;
+         coarse_node_start.push_back(coarse_n);
+      }
+
+      tentative.resize(n);
+      tentative.structure_stamp=new_structure_stamp();
+      tentative.colindex.clear();
+      tentative.value.clear();
+      tentative.rowstart[0]=0;
+      for(unsigned int i=0; i<n; ++i){
+         tentative.colindex.insert(tentative.colindex.end(), column_index[i].begin(), column_index[i].end());
+         tentative.value.insert(tentative.value.end(), column_values[i].begin(), column_values[i].end());
+         tentative.rowstart[i+1]=(unsigned int)tentative.colindex.size();
+      }
+      return coarse_n;
+   }
+
+   // result=a+b, both with sorted rows
+   void add_sparse(const FixedSparseMatrix<T> &a, const FixedSparseMatrix<T> &b, unsigned int columns, FixedSparseMatrix<T> &result)
+   {
+      result.resize(a.n);
+      result.structure_stamp=new_structure_stamp();
+      result.colindex.clear();
+      result.value.clear();
+      result.rowstart[0]=0;
+      for(unsigned int i=0; i<a.n; ++i){
+         unsigned int p=a.rowstart[i], q=b.rowstart[i];
+         while(p<a.rowstart[i+1] || q<b.rowstart[i+1]){
+            unsigned int ja=(p<a.rowstart[i+1] ? a.colindex[p] : columns), jb=(q<b.rowstart[i+1] ? b.colindex[q] : columns);
+            if(ja<jb){ result.colindex.push_back(ja); result.value.push_back(a.value[p++]); }
+            else if(jb<ja){ result.colindex.push_back(jb); result.value.push_back(b.value[q++]); }
+            else{ result.colindex.push_back(ja); result.value.push_back(a.value[p++]+b.value[q++]); }
+         }
+         result.rowstart[i+1]=(unsigned int)result.colindex.size();
+      }
+   }
+
+   // values of result=a+b, into the structure add_sparse gave
+   void add_sparse_values(const FixedSparseMatrix<T> &a, const FixedSparseMatrix<T> &b, unsigned int columns, FixedSparseMatrix<T> &result)
+   {
+      std::vector<T> sum(columns, 0);
+      for(unsigned int i=0; i<a.n; ++i){
+         for(unsigned int p=a.rowstart[i]; p<a.rowstart[i+1]; ++p) sum[a.colindex[p]]=a.value[p];
+         for(unsigned int q=b.rowstart[i]; q<b.rowstart[i+1]; ++q) sum[b.colindex[q]]+=b.value[q];
+         for(unsigned int p=result.rowstart[i]; p<result.rowstart[i+1]; ++p){
+            result.value[p]=sum[result.colindex[p]];
+            sum[result.colindex[p]]=0;
+         }
+      }
+   }
+
+   static T diagonal(const FixedSparseMatrix<T> &A, unsigned int i)
+   {
+      for(unsigned int p=A.rowstart[i]; p<A.rowstart[i+1]; ++p)
+         if(A.colindex[p]==i) return A.value[p];
+      return 0;
+   }
+
+   // estimate of the largest eigenvalue of D^{-1}*A by power iteration
+   T spectral_radius(SmoothedAggregationLevel<T> &level)
+   {
+      unsigned int n=level.A.n;
+      std::vector<T> &x=level.x, &y=level.r;
+      for(unsigned int i=0; i<n; ++i) x[i]=1+(T)((i*7919u)%113)/113; // fixed, varied start
+      T rho=1;
+      for(int iteration=0; iteration<15; ++iteration){
+         T norm=(T)std::sqrt(BLAS::dot(x, x));
+         if(norm==0) break;
+         multiply(level.A, x, y);
+         T rayleigh=0;
+         for(unsigned int i=0; i<n; ++i){
+            y[i]*=level.invdiag[i];
+            rayleigh+=x[i]*y[i];
+         }
+         rho=rayleigh/(norm*norm);
+         for(unsigned int i=0; i<n; ++i) x[i]=y[i]/norm;
+      }
+      // the Rayleigh quotient approaches from below: pad it a little
+      return rho>0 ? (T)1.1*rho : 1;
+   }
+
+   void gauss_seidel(SmoothedAggregationLevel<T> &level, bool forward)
+   {
+      const FixedSparseMatrix<T> &A=level.A;
+      unsigned int n=A.n;
+      for(unsigned int step=0; step<n; ++step){
+         unsigned int i=(forward ? step : n-1-step);
+         if(level.invdiag[i]==0) continue;
+         T sum=level.b[i];
+         for(unsigned int p=A.rowstart[i]; p<A.rowstart[i+1]; ++p)
+            if(A.colindex[p]!=i) sum-=A.value[p]*level.x[A.colindex[p]];
+         level.x[i]=sum*level.invdiag[i];
+      }
+   }
+
+   void v_cycle(unsigned int l)
+   {
+      SmoothedAggregationLevel<T> &f=levels[l];
+      if(l+1==levels.size()){
+         coarse_solver.solve(f.b, f.x);
+         return;
+      }
+      zero(f.x);
+      for(int sweep=0; sweep<pre_sweeps; ++sweep) gauss_seidel(f, true);
+
+      SmoothedAggregationLevel<T> &g=levels[l+1];
+      multiply(f.A, f.x, f.r);
+      for(unsigned int i=0; i<f.A.n; ++i) f.r[i]=f.b[i]-f.r[i];
+      multiply_rows(f.R, &f.r[0], &g.b[0], 0, f.R.n); // restrict
+      v_cycle(l+1);
+      for(unsigned int i=0; i<f.A.n; ++i){ // prolongate
+         T sum=0;
+         for(unsigned int p=f.P.rowstart[i]; p<f.P.rowstart[i+1]; ++p) sum+=f.P.value[p]*g.x[f.P.colindex[p]];
+         f.x[i]+=sum;
+      }
+
+      for(int sweep=0; sweep<post_sweeps; ++sweep) gauss_seidel(f, false);
+   }
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef SPARSE_CHOLESKY_H
+#define SPARSE_CHOLESKY_H
+
+// Simplicial sparse Cholesky factorization A=L*L^T of a symmetric positive
+// definite FixedSparseMatrix, for systems MIC(0) struggles with (e.g. viscosity
+// with very large viscosity ratios).
+//
+// The work is split the usual way:
+//  - analysis: a fill-reducing nested dissection ordering (recursive level-set
+//    bisection of the matrix graph), the elimination tree and the column
+//    counts of L. This depends only on the sparsity structure, so it is cached
+//    and redone only when the matrix's structure stamp changes.
+//  - numeric factorization: up-looking, one row of L at a time, with the row's
+//    pattern found by walking the elimination tree.
+//  - solve: permuted forward and back substitution.
+//
+// It is also a Preconditioner, so PCGSolver can use it: for a well-conditioned
+// matrix PCG then stops after one or two iterations, which act as iterative
+// refinement. That also covers nearly singular (semi-definite) matrices, where
+// a pivot that cancels to (almost) nothing is replaced by the original
+// diagonal entry, as MIC(0) does, making the factor inexact.
+
+#include <cassert>
+#include <cmath>
+#include <vector>
+#include "pcg_solver.h"
+
+enum SparseCholeskyOrdering {
+   CHOLESKY_ORDER_NATURAL,
+   CHOLESKY_ORDER_NESTED_DISSECTION
+};
+
+//============================================================================
+// Nested dissection ordering of the graph of a symmetric matrix. Each region
+// is split by the middle level set of a breadth-first search from a
+// pseudo-peripheral node; both halves are ordered (recursively) before the
+// separator, so eliminating one half never fills into the other.
+
+struct NestedDissection
+{
+   unsigned int leaf_size; // regions this small are kept in natural order
+
+   NestedDissection(void)
+      : leaf_size(32)
+   {}
+
+   // perm[k] is the unknown eliminated k-th
+   template<class T>
+   void order(const FixedSparseMatrix<T> &matrix, std::vector<unsigned int> &perm)
+   {
+      rowstart=&matrix.rowstart[0];
+      colindex=(matrix.colindex.empty() ? 0 : &matrix.colindex[0]);
+      unsigned int n=matrix.n;
+      region.assign(n, 0);
+      level.assign(n, -1);
+      next_region=1;
+      perm.clear();
+      perm.reserve(n);
+      std::vector<unsigned int> nodes(n);
+      for(unsigned int i=0; i<n; ++i) nodes[i]=i;
+      dissect(nodes, 0, perm);
+   }
+
+   protected:
+
+   const unsigned int *rowstart, *colindex;
+   std::vector<int> region; // region label of each node (-1 once ordered)
+   std::vector<int> level; // BFS level, -1 if unvisited
+   std::vector<unsigned int> queue;
+   int next_region;
+
+   // breadth-first search from root over the nodes of region r; the visited
+   // nodes are left in queue (by level) and the depth is returned
+   int bfs(unsigned int root, int r)
+   {
+      queue.clear();
+      queue.push_back(root);
+      level[root]=0;
+      int depth=0;
+      for(unsigned int head=0; head<queue.size(); ++head){
+         unsigned int i=queue[head];
+         depth=level[i];
+         for(unsigned int p=rowstart[i]; p<rowstart[i+1]; ++p){
+            unsigned int j=colindex[p];
+            if(region[j]==r && level[j]<0){
+               level[j]=level[i]+1;
+               queue.push_back(j);
+            }
+         }
+      }
+      return depth;
+   }
+
+   void clear_levels(void)
+   {
+      for(unsigned int q=0; q<queue.size(); ++q) level[queue[q]]=-1;
+   }
+
+   unsigned int degree(unsigned int i) const { return rowstart[i+1]-rowstart[i]; }
+
+   void relabel(const std::vector<unsigned int> &nodes, int r)
+   {
+      for(unsigned int a=0; a<nodes.size(); ++a) region[nodes[a]]=r;
+   }
+
+   void dissect(const std::vector<unsigned int> &nodes, int r, std::vector<unsigned int> &perm)
+   {
+      if(nodes.size()<=leaf_size){
+         for(unsigned int a=0; a<nodes.size(); ++a) region[nodes[a]]=-1;
+         perm.insert(perm.end(), nodes.begin(), nodes.end());
+         return;
+      }
+
+      // a disconnected region is ordered one component at a time
+      bfs(nodes[0], r);
+      if(queue.size()<nodes.size()){
+         std::vector<std::vector<unsigned int> > components;
+         clear_levels();
+         for(unsigned int a=0; a<nodes.size(); ++a){
+            if(region[nodes[a]]!=r) continue;
+            bfs(nodes[a], r);
+            components.push_back(queue);
+            clear_levels();
+            relabel(queue, next_region++);
+         }
+         for(unsigned int c=0; c<components.size(); ++c)
+            dissect(components[c], region[components[c][0]], perm);
+         return;
+      }
+
+      // pseudo-peripheral root: restart from a minimum-degree node of the last
+      // level while that makes the level structure deeper
+      unsigned int root=nodes[0];
+      clear_levels();
+      int depth=bfs(root, r);
+      for(int attempt=0; attempt<4; ++attempt){
+         unsigned int candidate=queue.back();
+         for(unsigned int q=queue.size(); q-->0 && level[queue[q]]==depth; )
+            if(degree(queue[q])<degree(candidate)) candidate=queue[q];
+         clear_levels();
+         int candidate_depth=bfs(candidate, r);
+         if(candidate_depth<=depth){
+            clear_levels();
+            depth=bfs(root, r);
+            break;
+         }
+         root=candidate;
+         depth=candidate_depth;
+      }
+      if(depth<2){
+         // too tightly connected to split
+         clear_levels();
+         for(unsigned int a=0; a<nodes.size(); ++a) region[nodes[a]]=-1;
+         perm.insert(perm.end(), nodes.begin(), nodes.end());
+         return;
+      }
+
+      // separator: the level holding the median node, kept off the ends
+      int middle=level[queue[queue.size()/2]];
+      if(middle<1) middle=1;
+      if(middle>depth-1) middle=depth-1;
+      std::vector<unsigned int> low, high, separator;
+      for(unsigned int q=0; q<queue.size(); ++q){
+         unsigned int i=queue[q];
+         if(level[i]<middle) low.push_back(i);
+         else if(level[i]>middle) high.push_back(i);
+         else separator.push_back(i);
+      }
+      clear_levels();
+      int low_region=next_region++, high_region=next_region++;
+      relabel(low, low_region);
+      relabel(high, high_region);
+      relabel(separator, -1);
+      dissect(low, low_region, perm);
+      dissect(high, high_region, perm);
+      perm.insert(perm.end(), separator.begin(), separator.end());
+   }
+};
+
+//============================================================================
+
+template<class T>
+struct SparseCholesky : public Preconditioner<T>
+{
+   SparseCholeskyOrdering ordering;
+   T min_pivot_ratio; // pivots below this fraction of the matrix diagonal are replaced by it
+   unsigned int perturbed_pivots; // how many were replaced in the last factorization
+   unsigned int n;
+   unsigned int structure_stamp; // matrix structure the analysis was done for (0: none)
+   std::vector<unsigned int> perm, pinv; // elimination order and its inverse
+   std::vector<int> parent; // elimination tree
+   std::vector<unsigned int> colstart; // columns of L, diagonal entry first
+   std::vector<unsigned int> rowindex;
+   std::vector<T> value;
+
+   SparseCholesky(void)
+      : ordering(CHOLESKY_ORDER_NESTED_DISSECTION), min_pivot_ratio(1e-12), perturbed_pivots(0), n(0), structure_stamp(0)
+   {}
+
+   // Preconditioner interface
+   void form(const FixedSparseMatrix<T> &matrix) { factor(matrix); }
+   void apply(const std::vector<T> &x, std::vector<T> &result) { solve(x, result); }
+
+   unsigned int factor_nonzeros(void) const { return colstart.empty() ? 0 : colstart[n]; }
+
+   // Symbolic analysis, skipped while the matrix keeps the same structure.
+   void analyze(const FixedSparseMatrix<T> &matrix)
+   {
+      if(matrix.structure_stamp!=0 && matrix.structure_stamp==structure_stamp && matrix.n==n) return;
+      n=matrix.n;
+      structure_stamp=matrix.structure_stamp;
+
+      if(ordering==CHOLESKY_ORDER_NESTED_DISSECTION){
+         NestedDissection dissection;
+         dissection.order(matrix, perm);
+      }else{
+         perm.resize(n);
+         for(unsigned int i=0; i<n; ++i) perm[i]=i;
+      }
+      pinv.resize(n);
+      for(unsigned int k=0; k<n; ++k) pinv[perm[k]]=k;
+
+      // elimination tree of the permuted matrix (Liu's algorithm with path compression)
+      parent.assign(n, -1);
+      std::vector<int> ancestor(n, -1);
+      for(unsigned int k=0; k<n; ++k){
+         unsigned int row=perm[k];
+         for(unsigned int p=matrix.rowstart[row]; p<matrix.rowstart[row+1]; ++p){
+            int i=(int)pinv[matrix.colindex[p]];
+            while(i!=-1 && i<(int)k){
+               int next=ancestor[i];
+               ancestor[i]=(int)k;
+               if(next==-1) parent[i]=(int)k;
+               i=next;
+            }
+         }
+      }
+
+      // column counts of L, from the row patterns
+      mark.assign(n, -1);
+      pattern.resize(n);
+      std::vector<unsigned int> count(n, 1);
+      for(unsigned int k=0; k<n; ++k){
+         unsigned int top=row_pattern(matrix, k);
+         for(unsigned int q=top; q<n; ++q) ++count[pattern[q]];
+      }
+      colstart.resize(n+1);
+      colstart[0]=0;
+      for(unsigned int k=0; k<n; ++k) colstart[k+1]=colstart[k]+count[k];
+      rowindex.resize(colstart[n]);
+      value.resize(colstart[n]);
+      x.assign(n, 0);
+      next.resize(n);
+   }
+
+   // Numeric factorization (analyzing first if needed). Returns false if a
+   // diagonal entry is not positive, or if any pivot had to be perturbed (the
+   // factor is then only approximate).
+   bool factor(const FixedSparseMatrix<T> &matrix)
+   {
+      analyze(matrix);
+      for(unsigned int k=0; k<n; ++k) next[k]=colstart[k];
+      mark.assign(n, -1);
+      perturbed_pivots=0;
+      bool positive_diagonal=true;
+      for(unsigned int k=0; k<n; ++k){
+         // scatter row k of the permuted matrix's lower triangle into x
+         unsigned int top=row_pattern(matrix, k);
+         unsigned int row=perm[k];
+         x[k]=0;
+         for(unsigned int p=matrix.rowstart[row]; p<matrix.rowstart[row+1]; ++p){
+            unsigned int i=pinv[matrix.colindex[p]];
+            if(i<=k) x[i]+=matrix.value[p];
+         }
+         T diagonal=x[k], d=diagonal;
+         x[k]=0;
+         // sparse triangular solve for row k of L
+         for(; top<n; ++top){
+            unsigned int i=pattern[top];
+            T lki=x[i]/value[colstart[i]];
+            x[i]=0;
+            for(unsigned int q=colstart[i]+1; q<next[i]; ++q)
+               x[rowindex[q]]-=value[q]*lki;
+            d-=lki*lki;
+            unsigned int q=next[i]++;
+            rowindex[q]=k;
+            value[q]=lki;
+         }
+         if(!(diagonal>0)){
+            positive_diagonal=false;
+            diagonal=1;
+         }
+         if(!(d>min_pivot_ratio*diagonal)){
+            d=diagonal;
+            ++perturbed_pivots;
+         }
+         unsigned int q=next[k]++;
+         rowindex[q]=k;
+         value[q]=std::sqrt(d);
+      }
+      return positive_diagonal && perturbed_pivots==0;
+   }
+
+   // result=A^{-1}*rhs, using the last factorization
+   void solve(const std::vector<T> &rhs, std::vector<T> &result)
+   {
+      assert(rhs.size()==n);
+      for(unsigned int k=0; k<n; ++k) x[k]=rhs[perm[k]];
+      // L*y=x
+      for(unsigned int k=0; k<n; ++k){
+         x[k]/=value[colstart[k]];
+         for(unsigned int q=colstart[k]+1; q<colstart[k+1]; ++q)
+            x[rowindex[q]]-=value[q]*x[k];
+      }
+      // L^T*z=y
+      for(unsigned int k=n; k-->0; ){
+         for(unsigned int q=colstart[k]+1; q<colstart[k+1]; ++q)
+            x[k]-=value[q]*x[rowindex[q]];
+         x[k]/=value[colstart[k]];
+      }
+      result.resize(n);
+      for(unsigned int k=0; k<n; ++k) result[perm[k]]=x[k];
+   }
+
+   protected:
+
+   std::vector<T> x; // dense work vector
+   std::vector<int> mark;
+   std::vector<unsigned int> pattern, next;
+
+   // Pattern of row k of L (excluding the diagonal), found by climbing the
+   // elimination tree from each entry of row k of the permuted matrix. The
+   // columns end up in pattern[top..n) in topological order; returns top.
+   unsigned int row_pattern(const FixedSparseMatrix<T> &matrix, unsigned int k)
+   {
+      unsigned int top=n;
+      mark[k]=(int)k;
+      unsigned int row=perm[k];
+      for(unsigned int p=matrix.rowstart[row]; p<matrix.rowstart[row+1]; ++p){
+         unsigned int i=pinv[matrix.colindex[p]];
+         if(i>k) continue;
+         unsigned int length=0;
+         for(; mark[i]!=(int)k; i=(unsigned int)parent[i]){
+            pattern[length++]=i; // temporarily at the front
+            mark[i]=(int)k;
+         }
+         while(length>0) pattern[--top]=pattern[--length];
+      }
+      return top;
+   }
+};
+
+#endif
@@ -3,54 +3,87 @@
 
 #include <iostream>
 #include <vector>
+#include "blas_wrapper.h"
 #include "util.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //============================================================================
 // Dynamic compressed sparse row matrix.
+//
+// All rows live in one pair of slab arrays (index/value), each row in its own
+// range of slots with room to grow. A row that outgrows its slots moves to the
+// end of the slab with twice the capacity, and the abandoned slots are
+// reclaimed by compacting the slab once they make up half of it. So building
+// a matrix does not allocate per row, and zero() only resets the row lengths,
+// keeping every row's capacity for the next assembly.
 
 template<class T>
 struct SparseMatrix
 {
    unsigned int n; // dimension
-   std::vector<std::vector<unsigned int> > index; // for each row, a list of all column indices (sorted)
-   std::vector<std::vector<T> > value; // values corresponding to index
+   unsigned int expected_row_size; // slots given to each new row
+   std::vector<unsigned int> rowstart; // where each row's slots begin in index and value
+   std::vector<unsigned int> capacity; // slots reserved for each row
+   std::vector<unsigned int> count; // entries in each row
+   std::vector<unsigned int> index; // column indices, sorted within each row
+   std::vector<T> value; // values corresponding to index
+   unsigned int abandoned; // slots left behind by rows that moved
 
    explicit SparseMatrix(unsigned int n_=0, unsigned int expected_nonzeros_per_row=7)
-      : n(n_), index(n_), value(n_)
+      : n(0), expected_row_size(expected_nonzeros_per_row), abandoned(0)
    {
-      for(unsigned int i=0; i<n; ++i){
-         index[i].reserve(expected_nonzeros_per_row);
-         value[i].reserve(expected_nonzeros_per_row);
-      }
+      resize(n_);
    }
 
    void clear(void)
    {
       n=0;
+      rowstart.clear();
+      capacity.clear();
+      count.clear();
       index.clear();
       value.clear();
+      abandoned=0;
    }
 
+   // remove all entries but keep the storage
    void zero(void)
    {
-      for(unsigned int i=0; i<n; ++i){
-         index[i].resize(0);
-         value[i].resize(0);
-      }
+      for(unsigned int i=0; i<n; ++i) count[i]=0;
    }
 
    void resize(int n_)
    {
+      unsigned int old_n=n;
       n=n_;
-      index.resize(n);
-      value.resize(n);
+      if(n<old_n){
+         for(unsigned int i=n; i<old_n; ++i) abandoned+=capacity[i];
+         rowstart.resize(n);
+         capacity.resize(n);
+         count.resize(n);
+         if(2*abandoned>index.size()) compact();
+         return;
+      }
+      rowstart.resize(n);
+      capacity.resize(n, expected_row_size);
+      count.resize(n, 0);
+      unsigned int end=(unsigned int)index.size();
+      for(unsigned int i=old_n; i<n; ++i){
+         rowstart[i]=end;
+         end+=expected_row_size;
+      }
+      index.resize(end);
+      value.resize(end);
    }
 
    T operator()(unsigned int i, unsigned int j) const
    {
-      for(unsigned int k=0; k<index[i].size(); ++k){
-         if(index[i][k]==j) return value[i][k];
-         else if(index[i][k]>j) return 0;
+      const unsigned int *row=row_index(i);
+      for(unsigned int k=0; k<count[i]; ++k){
+         if(row[k]==j) return value[rowstart[i]+k];
+         else if(row[k]>j) return 0;
       }
       return 0;
    }
@@ -58,99 +91,164 @@ struct SparseMatrix
    void set_element(unsigned int i, unsigned int j, T new_value)
    {
       unsigned int k=0;
-      for(; k<index[i].size(); ++k){
-         if(index[i][k]==j){
-            value[i][k]=new_value;
-            return;
-         }else if(index[i][k]>j){
-            insert(index[i], k, j);
-            insert(value[i], k, new_value);
+      for(; k<count[i]; ++k){
+         unsigned int column=index[rowstart[i]+k];
+         if(column==j){
+            value[rowstart[i]+k]=new_value;
             return;
-         }
+         }else if(column>j)
+            break;
       }
-      index[i].push_back(j);
-      value[i].push_back(new_value);
+      insert_entry(i, k, j, new_value);
    }
 
    void add_to_element(unsigned int i, unsigned int j, T increment_value)
    {
       unsigned int k=0;
-      for(; k<index[i].size(); ++k){
-         if(index[i][k]==j){
-            value[i][k]+=increment_value;
-            return;
-         }else if(index[i][k]>j){
-            insert(index[i], k, j);
-            insert(value[i], k, increment_value);
+      for(; k<count[i]; ++k){
+         unsigned int column=index[rowstart[i]+k];
+         if(column==j){
+            value[rowstart[i]+k]+=increment_value;
             return;
-         }
+         }else if(column>j)
+            break;
       }
-      index[i].push_back(j);
-      value[i].push_back(increment_value);
+      insert_entry(i, k, j, increment_value);
    }
 
    // assumes indices is already sorted
    void add_sparse_row(unsigned int i, const std::vector<unsigned int> &indices, const std::vector<T> &values)
    {
       unsigned int j=0, k=0;
-      while(j<indices.size() && k<index[i].size()){
-         if(index[i][k]<indices[j]){
+      while(j<indices.size() && k<count[i]){
+         unsigned int column=index[rowstart[i]+k];
+         if(column<indices[j]){
             ++k;
-         }else if(index[i][k]>indices[j]){
-            insert(index[i], k, indices[j]);
-            insert(value[i], k, values[j]);
+         }else if(column>indices[j]){
+            insert_entry(i, k, indices[j], values[j]);
             ++j;
+            ++k;
          }else{
-            value[i][k]+=values[j];
+            value[rowstart[i]+k]+=values[j];
             ++j;
             ++k;
          }
       }
-      for(;j<indices.size(); ++j){
-         index[i].push_back(indices[j]);
-         value[i].push_back(values[j]);
-      }
+      for(;j<indices.size(); ++j)
+         insert_entry(i, count[i], indices[j], values[j]);
    }
 
    // assumes matrix has symmetric structure - so the indices in row i tell us which columns to delete i from
    void symmetric_remove_row_and_column(unsigned int i)
    {
-      for(unsigned int a=0; a<index[i].size(); ++a){
-         unsigned int j=index[i][a]; // 
-         for(unsigned int b=0; b<index[j].size(); ++b){
-            if(index[j][b]==i){
-               erase(index[j], b);
-               erase(value[j], b);
+      for(unsigned int a=0; a<count[i]; ++a){
+         unsigned int j=index[rowstart[i]+a];
+         for(unsigned int b=0; b<count[j]; ++b){
+            if(index[rowstart[j]+b]==i){
+               erase_entry(j, b);
                break;
             }
          }
       }
-      index[i].resize(0);
-      value[i].resize(0);
+      count[i]=0;
+   }
+
+   unsigned int row_size(unsigned int i) const { return count[i]; }
+   const unsigned int *row_index(unsigned int i) const { return index.empty() ? 0 : &index[0]+rowstart[i]; }
+   const T *row_value(unsigned int i) const { return value.empty() ? 0 : &value[0]+rowstart[i]; }
+
+   // pack the rows back to back again, each keeping its capacity
+   void compact(void)
+   {
+      unsigned int total=0;
+      for(unsigned int i=0; i<n; ++i) total+=capacity[i];
+      std::vector<unsigned int> packed_index(total);
+      std::vector<T> packed_value(total);
+      unsigned int start=0;
+      for(unsigned int i=0; i<n; ++i){
+         for(unsigned int k=0; k<count[i]; ++k){
+            packed_index[start+k]=index[rowstart[i]+k];
+            packed_value[start+k]=value[rowstart[i]+k];
+         }
+         rowstart[i]=start;
+         start+=capacity[i];
+      }
+      index.swap(packed_index);
+      value.swap(packed_value);
+      abandoned=0;
    }
 
    void write_matlab(std::ostream &output, const char *variable_name)
    {
       output<<variable_name<<"=sparse([";
       for(unsigned int i=0; i<n; ++i){
-         for(unsigned int j=0; j<index[i].size(); ++j){
+         for(unsigned int j=0; j<count[i]; ++j){
             output<<i+1<<" ";
          }
       }
       output<<"],...\n  [";
       for(unsigned int i=0; i<n; ++i){
-         for(unsigned int j=0; j<index[i].size(); ++j){
-            output<<index[i][j]+1<<" ";
+         for(unsigned int j=0; j<count[i]; ++j){
+            output<<index[rowstart[i]+j]+1<<" ";
          }
       }
       output<<"],...\n  [";
       for(unsigned int i=0; i<n; ++i){
-         for(unsigned int j=0; j<value[i].size(); ++j){
-            output<<value[i][j]<<" ";
+         for(unsigned int j=0; j<count[i]; ++j){
+            output<<value[rowstart[i]+j]<<" ";
          }
       }
       output<<"], "<<n<<", "<<n<<");"<<std::endl;
    }
+
+   protected:
+
+   // put (j, new_value) at position k of row i, shifting the rest along
+   void insert_entry(unsigned int i, unsigned int k, unsigned int j, T new_value)
+   {
+      if(count[i]==capacity[i]) grow_row(i);
+      unsigned int start=rowstart[i];
+      for(unsigned int a=count[i]; a>k; --a){
+         index[start+a]=index[start+a-1];
+         value[start+a]=value[start+a-1];
+      }
+      index[start+k]=j;
+      value[start+k]=new_value;
+      ++count[i];
+   }
+
+   void erase_entry(unsigned int i, unsigned int k)
+   {
+      unsigned int start=rowstart[i];
+      for(unsigned int a=k+1; a<count[i]; ++a){
+         index[start+a-1]=index[start+a];
+         value[start+a-1]=value[start+a];
+      }
+      --count[i];
+   }
+
+   // double the capacity of row i, in place if it is the last row of the slab
+   void grow_row(unsigned int i)
+   {
+      unsigned int new_capacity=(capacity[i]>0 ? 2*capacity[i] : 4);
+      unsigned int end=(unsigned int)index.size();
+      if(rowstart[i]+capacity[i]==end){
+         index.resize(rowstart[i]+new_capacity);
+         value.resize(rowstart[i]+new_capacity);
+         capacity[i]=new_capacity;
+         return;
+      }
+      index.resize(end+new_capacity);
+      value.resize(end+new_capacity);
+      for(unsigned int k=0; k<count[i]; ++k){
+         index[end+k]=index[rowstart[i]+k];
+         value[end+k]=value[rowstart[i]+k];
+      }
+      abandoned+=capacity[i];
+      rowstart[i]=end;
+      capacity[i]=new_capacity;
+      if(2*abandoned>index.size()) compact();
+   }
 };
 
 typedef SparseMatrix<float> SparseMatrixf;
@@ -163,10 +261,12 @@ void multiply(const SparseMatrix<T> &matrix, const std::vector<T> &x, std::vecto
    assert(matrix.n==x.size());
    result.resize(matrix.n);
    for(unsigned int i=0; i<matrix.n; ++i){
-      result[i]=0;
-      for(unsigned int j=0; j<matrix.index[i].size(); ++j){
-         result[i]+=matrix.value[i][j]*x[matrix.index[i][j]];
-      }
+      const unsigned int *index=matrix.row_index(i);
+      const T *value=matrix.row_value(i);
+      T sum=0;
+      for(unsigned int j=0; j<matrix.row_size(i); ++j)
+         sum+=value[j]*x[index[j]];
+      result[i]=sum;
    }
 }
 
@@ -177,10 +277,130 @@ void multiply_and_subtract(const SparseMatrix<T> &matrix, const std::vector<T> &
    assert(matrix.n==x.size());
    result.resize(matrix.n);
    for(unsigned int i=0; i<matrix.n; ++i){
-      for(unsigned int j=0; j<matrix.index[i].size(); ++j){
-         result[i]-=matrix.value[i][j]*x[matrix.index[i][j]];
+      const unsigned int *index=matrix.row_index(i);
+      const T *value=matrix.row_value(i);
+      for(unsigned int j=0; j<matrix.row_size(i); ++j)
+         result[i]-=value[j]*x[index[j]];
+   }
+}
+
+//============================================================================
+// Assembly buffer for building a FixedSparseMatrix directly, without the
+// per-element vector inserts of SparseMatrix. Each row has a fixed number of
+// slots: add_to_element sums into an existing slot with the same column or
+// claims a free one, so distinct rows can be filled independently, also from
+// different threads at once. Entries that do not fit spill into a shared
+// (row, column, value) triplet list, which must not happen in a parallel
+// region: update_from_builder relies on the spill order. Rows are sorted and
+// duplicates summed when the fixed matrix is constructed.
+
+template<class T>
+struct SparseMatrixBuilder
+{
+   unsigned int n; // dimension
+   unsigned int slots; // capacity of each row
+   std::vector<unsigned int> count; // number of slots used in each row
+   std::vector<unsigned int> index; // column indices, slots per row (unsorted)
+   std::vector<T> value; // values corresponding to index
+   std::vector<unsigned int> extra_row, extra_col; // triplets that did not fit in their row's slots
+   std::vector<T> extra_value;
+
+   explicit SparseMatrixBuilder(unsigned int n_=0, unsigned int slots_per_row=7)
+      : n(n_), slots(slots_per_row), count(n_,0), index(n_*slots_per_row), value(n_*slots_per_row)
+   {}
+
+   void clear(void)
+   {
+      n=0;
+      count.clear();
+      index.clear();
+      value.clear();
+      extra_row.clear();
+      extra_col.clear();
+      extra_value.clear();
+   }
+
+   // remove all entries but keep the storage
+   void zero(void)
+   {
+      for(unsigned int i=0; i<n; ++i) count[i]=0;
+      extra_row.resize(0);
+      extra_col.resize(0);
+      extra_value.resize(0);
+   }
+
+   void resize(unsigned int n_, unsigned int slots_per_row)
+   {
+      n=n_;
+      slots=slots_per_row;
+      count.resize(n);
+      index.resize(n*slots);
+      value.resize(n*slots);
+      zero();
+   }
+
+   // (set_element only overwrites entries held in the row's slots, not spilled triplets)
+   void set_element(unsigned int i, unsigned int j, T new_value)
+   {
+      unsigned int *row_index=&index[i*slots];
+      for(unsigned int k=0; k<count[i]; ++k){
+         if(row_index[k]==j){
+            value[i*slots+k]=new_value;
+            return;
+         }
+      }
+      append(i, j, new_value);
+   }
+
+   void add_to_element(unsigned int i, unsigned int j, T increment_value)
+   {
+      unsigned int *row_index=&index[i*slots];
+      for(unsigned int k=0; k<count[i]; ++k){
+         if(row_index[k]==j){
+            value[i*slots+k]+=increment_value;
+            return;
+         }
       }
+      append(i, j, increment_value);
    }
+
+   // add a triplet without looking for an existing entry
+   void append(unsigned int i, unsigned int j, T new_value)
+   {
+      assert(i<n && j<n);
+      if(count[i]<slots){
+         index[i*slots+count[i]]=j;
+         value[i*slots+count[i]]=new_value;
+         ++count[i];
+      }else{
+#ifdef _OPENMP
+         assert(!omp_in_parallel()); // concurrently filled rows must fit their slots
+#endif
+         extra_row.push_back(i);
+         extra_col.push_back(j);
+         extra_value.push_back(new_value);
+      }
+   }
+};
+
+typedef SparseMatrixBuilder<float> SparseMatrixBuilderf;
+typedef SparseMatrixBuilder<double> SparseMatrixBuilderd;
+
+// column of a builder entry, numbered as in FixedSparseMatrix::construct_from_builder
+template<class T>
+inline unsigned int builder_column(const SparseMatrixBuilder<T> &builder, unsigned int e)
+{
+   unsigned int slot_count=builder.n*builder.slots;
+   return e<slot_count ? builder.index[e] : builder.extra_col[e-slot_count];
+}
+
+// A fresh nonzero id for each newly built sparsity structure, so that
+// factorizations can tell when they may reuse their own symbolic structure.
+inline unsigned int new_structure_stamp(void)
+{
+   static unsigned int last_stamp=0;
+   if(++last_stamp==0) ++last_stamp;
+   return last_stamp;
 }
 
 //============================================================================
@@ -195,9 +415,11 @@ struct FixedSparseMatrix
    std::vector<T> value; // nonzero values row by row
    std::vector<unsigned int> colindex; // corresponding column indices
    std::vector<unsigned int> rowstart; // where each row starts in value and colindex (and last entry is one past the end, the number of nonzeros)
+   unsigned int structure_stamp; // changes whenever rowstart/colindex are rebuilt (0 if unknown)
+   std::vector<unsigned int> builder_position; // where each SparseMatrixBuilder entry went, for update_from_builder
 
    explicit FixedSparseMatrix(unsigned int n_=0)
-      : n(n_), value(0), colindex(0), rowstart(n_+1)
+      : n(n_), value(0), colindex(0), rowstart(n_+1), structure_stamp(0)
    {}
 
    void clear(void)
@@ -206,33 +428,137 @@ struct FixedSparseMatrix
       value.clear();
       colindex.clear();
       rowstart.clear();
+      builder_position.clear();
+      structure_stamp=0;
    }
 
    void resize(int n_)
    {
       n=n_;
       rowstart.resize(n+1);
+      structure_stamp=0;
    }
 
    void construct_from_matrix(const SparseMatrix<T> &matrix)
    {
       resize(matrix.n);
+      structure_stamp=new_structure_stamp();
       rowstart[0]=0;
       for(unsigned int i=0; i<n; ++i){
-         rowstart[i+1]=rowstart[i]+matrix.index[i].size();
+         rowstart[i+1]=rowstart[i]+matrix.row_size(i);
       }
       value.resize(rowstart[n]);
       colindex.resize(rowstart[n]);
       unsigned int j=0;
       for(unsigned int i=0; i<n; ++i){
-         for(unsigned int k=0; k<matrix.index[i].size(); ++k){
-            value[j]=matrix.value[i][k];
-            colindex[j]=matrix.index[i][k];
+         const unsigned int *index=matrix.row_index(i);
+         const T *row_value=matrix.row_value(i);
+         for(unsigned int k=0; k<matrix.row_size(i); ++k){
+            value[j]=row_value[k];
+            colindex[j]=index[k];
             ++j;
          }
       }
    }
 
+   // Builds the sparsity structure and values (sorted rows, duplicates summed),
+   // remembering where each builder entry lands so update_from_builder can
+   // later refresh the values alone.
+   void construct_from_builder(const SparseMatrixBuilder<T> &builder)
+   {
+      resize(builder.n);
+      structure_stamp=new_structure_stamp();
+      unsigned int slot_count=builder.n*builder.slots;
+      // bucket any spilled triplets by row (counting sort)
+      std::vector<unsigned int> extra_start, extra_order;
+      if(!builder.extra_row.empty()){
+         extra_start.assign(n+1, 0);
+         for(unsigned int e=0; e<builder.extra_row.size(); ++e) ++extra_start[builder.extra_row[e]+1];
+         for(unsigned int i=0; i<n; ++i) extra_start[i+1]+=extra_start[i];
+         extra_order.resize(builder.extra_row.size());
+         std::vector<unsigned int> fill(extra_start.begin(), extra_start.end()-1);
+         for(unsigned int e=0; e<builder.extra_row.size(); ++e) extra_order[fill[builder.extra_row[e]]++]=e;
+      }
+      unsigned int total=slot_count+(unsigned int)builder.extra_row.size();
+      builder_position.resize(total);
+      value.resize(total);
+      colindex.resize(total);
+      std::vector<unsigned int> entry; // builder entries of the current row: slot number, or slot_count+e for spill e
+      unsigned int nnz=0;
+      rowstart[0]=0;
+      for(unsigned int i=0; i<n; ++i){
+         entry.resize(0);
+         for(unsigned int k=0; k<builder.count[i]; ++k) entry.push_back(i*builder.slots+k);
+         if(!extra_start.empty()){
+            for(unsigned int e=extra_start[i]; e<extra_start[i+1]; ++e) entry.push_back(slot_count+extra_order[e]);
+         }
+         // insertion sort by column (rows are short)
+         for(unsigned int a=1; a<entry.size(); ++a){
+            unsigned int e=entry[a], j=builder_column(builder, e), b=a;
+            while(b>0 && builder_column(builder, entry[b-1])>j){
+               entry[b]=entry[b-1];
+               --b;
+            }
+            entry[b]=e;
+         }
+         unsigned int start=nnz;
+         for(unsigned int a=0; a<entry.size(); ++a){
+            unsigned int e=entry[a], j=builder_column(builder, e);
+            T v=(e<slot_count ? builder.value[e] : builder.extra_value[e-slot_count]);
+            if(nnz>start && colindex[nnz-1]==j){
+               value[nnz-1]+=v;
+            }else{
+               colindex[nnz]=j;
+               value[nnz]=v;
+               ++nnz;
+            }
+            builder_position[e]=nnz-1;
+         }
+         rowstart[i+1]=nnz;
+      }
+      value.resize(nnz);
+      colindex.resize(nnz);
+   }
+
+   // Numeric-only refresh: the builder must hold the same entries in the same
+   // slots as when construct_from_builder was last called (i.e. it was filled by
+   // the same sequence of add_to_element/set_element calls, possibly with
+   // different values). The sparsity structure and structure_stamp are kept.
+   void update_from_builder(const SparseMatrixBuilder<T> &builder)
+   {
+      assert(builder.n==n && structure_stamp!=0);
+      unsigned int slot_count=builder.n*builder.slots;
+      assert(builder_position.size()==slot_count+builder.extra_row.size());
+      for(unsigned int p=0; p<value.size(); ++p) value[p]=0;
+      for(unsigned int i=0; i<n; ++i){
+         for(unsigned int k=i*builder.slots; k<i*builder.slots+builder.count[i]; ++k)
+            value[builder_position[k]]+=builder.value[k];
+      }
+      for(unsigned int e=0; e<builder.extra_value.size(); ++e)
+         value[builder_position[slot_count+e]]+=builder.extra_value[e];
+   }
+
+   // Copy of a matrix with another value type (e.g. float storage of a double
+   // system). The structure stamp is shared, so while the source keeps its
+   // structure only the values are converted.
+   template<class S>
+   void construct_converted(const FixedSparseMatrix<S> &matrix)
+   {
+      if(structure_stamp==0 || structure_stamp!=matrix.structure_stamp || n!=matrix.n){
+         n=matrix.n;
+         rowstart=matrix.rowstart;
+         colindex=matrix.colindex;
+         builder_position.clear();
+         structure_stamp=matrix.structure_stamp;
+      }
+      value.resize(matrix.value.size());
+      for(unsigned int p=0; p<value.size(); ++p) value[p]=(T)matrix.value[p];
+   }
+
+   unsigned int row_size(unsigned int i) const { return rowstart[i+1]-rowstart[i]; }
+   const unsigned int *row_index(unsigned int i) const { return colindex.empty() ? 0 : &colindex[rowstart[i]]; }
+   const T *row_value(unsigned int i) const { return value.empty() ? 0 : &value[rowstart[i]]; }
+
    void write_matlab(std::ostream &output, const char *variable_name)
    {
       output<<variable_name<<"=sparse([";
@@ -260,16 +586,112 @@ struct FixedSparseMatrix
 typedef FixedSparseMatrix<float> FixedSparseMatrixf;
 typedef FixedSparseMatrix<double> FixedSparseMatrixd;
 
+// structure stamps (0 means the structure may change at any time)
+template<class T>
+inline unsigned int matrix_structure_stamp(const SparseMatrix<T> &matrix)
+{ return 0; }
+
+template<class T>
+inline unsigned int matrix_structure_stamp(const FixedSparseMatrix<T> &matrix)
+{ return matrix.structure_stamp; }
+
+// rows [begin,end) of result=matrix*x
+template<class T>
+inline void multiply_rows(const FixedSparseMatrix<T> &matrix, const T *x, T *result, unsigned int begin, unsigned int end)
+{
+   const unsigned int *rowstart=&matrix.rowstart[0];
+   const unsigned int *colindex=(matrix.colindex.empty() ? 0 : &matrix.colindex[0]);
+   const T *value=(matrix.value.empty() ? 0 : &matrix.value[0]);
+   for(unsigned int i=begin; i<end; ++i){
+      T sum=0;
+      for(unsigned int j=rowstart[i]; j<rowstart[i+1]; ++j)
+         sum+=value[j]*x[colindex[j]];
+      result[i]=sum;
+   }
+}
+
 // perform result=matrix*x
 template<class T>
 void multiply(const FixedSparseMatrix<T> &matrix, const std::vector<T> &x, std::vector<T> &result)
 {
    assert(matrix.n==x.size());
    result.resize(matrix.n);
-   for(unsigned int i=0; i<matrix.n; ++i){
-      result[i]=0;
-      for(unsigned int j=matrix.rowstart[i]; j<matrix.rowstart[i+1]; ++j){
-         result[i]+=matrix.value[j]*x[matrix.colindex[j]];
+   int n=(int)matrix.n;
+   if(n==0) return;
+   const int block=(int)BLAS::BLOCK_SIZE;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=(int)BLAS::MIN_PARALLEL_SIZE)
+#endif
+   for(int begin=0; begin<n; begin+=block)
+      multiply_rows(matrix, &x[0], &result[0], begin, std::min(begin+block, n));
+}
+
+// perform result=matrix*x, returning dot(x, result) in the same pass over
+// memory; the sum is blocked exactly as BLAS::dot's, so it gives the same value
+template<class T>
+double multiply_dot(const FixedSparseMatrix<T> &matrix, const std::vector<T> &x, std::vector<T> &result)
+{
+   assert(matrix.n==x.size());
+   result.resize(matrix.n);
+   unsigned int n=matrix.n;
+   if(n==0) return 0;
+   const unsigned int block=BLAS::BLOCK_SIZE, pass=BLAS::BLOCK_SIZE*BLAS::MAX_PASS_BLOCKS;
+   const T *xp=&x[0];
+   T *rp=&result[0];
+   double sum=0;
+   for(unsigned int start=0; start<n; start+=pass){
+      unsigned int end=(n-start>pass ? start+pass : n);
+      int blocks=(int)((end-start+block-1)/block);
+      double partial[BLAS::MAX_PASS_BLOCKS];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=BLAS::MIN_PARALLEL_SIZE)
+#endif
+      for(int b=0; b<blocks; ++b){
+         unsigned int begin=start+b*block, block_end=std::min(begin+block, end);
+         multiply_rows(matrix, xp, rp, begin, block_end);
+         partial[b]=BLAS::block_dot(xp+begin, rp+begin, block_end-begin);
+      }
+      for(int b=0; b<blocks; ++b)
+         sum+=partial[b];
+   }
+   return sum;
+}
+
+// perform result=matrix*x, and from the same pass over memory dot(x, y),
+// dot(x, result) and the inf-norm of y (the one reduction per iteration of
+// single-reduction CG); the sums are blocked as BLAS::dot's
+template<class T>
+void multiply_dots(const FixedSparseMatrix<T> &matrix, const std::vector<T> &x, std::vector<T> &result, const std::vector<T> &y,
+                   double &x_dot_y, double &x_dot_result, double &y_abs_max)
+{
+   assert(matrix.n==x.size() && matrix.n==y.size());
+   result.resize(matrix.n);
+   x_dot_y=x_dot_result=y_abs_max=0;
+   unsigned int n=matrix.n;
+   if(n==0) return;
+   const unsigned int block=BLAS::BLOCK_SIZE, pass=BLAS::BLOCK_SIZE*BLAS::MAX_PASS_BLOCKS;
+   const T *xp=&x[0], *yp=&y[0];
+   T *rp=&result[0];
+   for(unsigned int start=0; start<n; start+=pass){
+      unsigned int end=(n-start>pass ? start+pass : n);
+      int blocks=(int)((end-start+block-1)/block);
+      double partial_y[BLAS::MAX_PASS_BLOCKS], partial_result[BLAS::MAX_PASS_BLOCKS], partial_max[BLAS::MAX_PASS_BLOCKS];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if(n>=BLAS::MIN_PARALLEL_SIZE)
+#endif
+      for(int b=0; b<blocks; ++b){
+         unsigned int begin=start+b*block, block_end=std::min(begin+block, end);
+         multiply_rows(matrix, xp, rp, begin, block_end);
+         partial_y[b]=BLAS::block_dot(xp+begin, yp+begin, block_end-begin);
+         partial_result[b]=BLAS::block_dot(xp+begin, rp+begin, block_end-begin);
+         double m=0;
+         for(unsigned int i=begin; i<block_end; ++i) m=std::max(m, std::fabs((double)yp[i]));
+         partial_max[b]=m;
+      }
+      for(int b=0; b<blocks; ++b){
+         x_dot_y+=partial_y[b];
+         x_dot_result+=partial_result[b];
+         y_abs_max=std::max(y_abs_max, partial_max[b]);
       }
    }
 }
@@ -0,0 +1,89 @@
+#include "scenes.h"
+
+#include <cstring>
+
+#include "fluidsim.h"
+#include "util.h"
+
+Vec2f c0(0.5f,0.5f), c1(0.7f,0.5f), c2(0.3f,0.35f), c3(0.5f,0.7f);
+float rad0 = 0.4f,  rad1 = 0.1f,  rad2 = 0.1f,   rad3 = 0.1f;
+
+float circle_phi(const Vec2f& position, const Vec2f& centre, float radius) {
+   return (dist(position,centre) - radius);
+}
+
+float boundary_phi(const Vec2f& position) {
+   float phi0 = -circle_phi(position, c0, rad0);
+   //the inner circles c1-c3 are currently left out of the domain:
+   //return min(min(phi0,phi1),min(phi2,phi3)) with phii = circle_phi(position, ci, radi)
+   return phi0;
+}
+
+bool parse_scene(const char* name, SceneType& scene) {
+   if(strcmp(name, "all") == 0)
+      scene = SCENE_ALL;
+   else if(strcmp(name, "column") == 0)
+      scene = SCENE_COLUMN;
+   else if(strcmp(name, "beam") == 0)
+      scene = SCENE_BEAM;
+   else if(strcmp(name, "disk") == 0)
+      scene = SCENE_DISK;
+   else
+      return false;
+   return true;
+}
+
+const char* scene_name(SceneType scene) {
+   switch(scene) {
+      case SCENE_COLUMN: return "column";
+      case SCENE_BEAM: return "beam";
+      case SCENE_DISK: return "disk";
+      default: return "all";
+   }
+}
+
+static bool in_column(const Vec2f& pt) {
+   return pt[0] > 0.42f && pt[0] < 0.46f;
+}
+
+static bool in_beam(const Vec2f& pt) {
+   return pt[0] < 0.36 && pt[1] > 0.45f && pt[1] < 0.5f;
+}
+
+static bool in_disk(const Vec2f& pt) {
+   return circle_phi(pt, Vec2f(0.7f, 0.65f), 0.15f) < 0;
+}
+
+void setup_scene(FluidSim& sim, SceneType scene, int grid_resolution, float grid_width) {
+
+   //Set up the simulation
+   sim.initialize(grid_width, grid_resolution, grid_resolution);
+
+   //set up a circle boundary
+   sim.set_boundary(boundary_phi);
+
+   //Stick some liquid particles in the domain
+   int offset = 0;
+   for(int i = 0; i < sqr(grid_resolution); ++i) {
+      for(int parts = 0; parts < 3; ++parts) {
+         float x = randhashf(++offset, 0,1);
+         float y = randhashf(++offset, 0,1);
+         Vec2f pt(x,y);
+
+         if(boundary_phi(pt) <= 0)
+            continue;
+
+         bool inside = false;
+         switch(scene) {
+            case SCENE_COLUMN: inside = in_column(pt); break;
+            case SCENE_BEAM: inside = in_beam(pt); break;
+            case SCENE_DISK: inside = in_disk(pt); break;
+            default:
+               //add a column (for buckling) and a beam (for bending) and a disk (for rolling and flowing)
+               inside = in_column(pt) || in_beam(pt) || in_disk(pt);
+         }
+         if(inside)
+            sim.add_particle(pt);
+      }
+   }
+}
@@ -0,0 +1,32 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "vec.h"
+
+class FluidSim;
+
+//Scene definitions shared by the GLUT viewer and the headless driver.
+//Nothing in here touches OpenGL.
+
+enum SceneType {
+   SCENE_ALL,     //column, beam and disk together (the original demo)
+   SCENE_COLUMN,  //a thin column, for buckling
+   SCENE_BEAM,    //a cantilevered beam, for bending
+   SCENE_DISK     //a disk, for rolling and flowing
+};
+
+//Boundary definition - several circles in a circular domain.
+extern Vec2f c0, c1, c2, c3;
+extern float rad0, rad1, rad2, rad3;
+
+float circle_phi(const Vec2f& position, const Vec2f& centre, float radius);
+float boundary_phi(const Vec2f& position);
+
+//Map a scene name ("all", "column", "beam", "disk") to a SceneType; returns false if unknown.
+bool parse_scene(const char* name, SceneType& scene);
+const char* scene_name(SceneType scene);
+
+//Initialize the simulator, set the boundary and seed liquid particles for the given scene.
+void setup_scene(FluidSim& sim, SceneType scene, int grid_resolution, float grid_width);
+
+#endif
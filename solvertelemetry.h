@@ -0,0 +1,108 @@
+#ifndef SOLVERTELEMETRY_H
+#define SOLVERTELEMETRY_H
+
+// A record of every linear solve the simulation makes: size, non-zeros,
+// iterations, residuals, timings and convergence, as reported by PCGSolver.
+// Records go into a fixed-capacity ring buffer, so a long production run
+// keeps only the most recent ones at a constant memory cost.
+
+#include <ostream>
+#include <vector>
+#include "pcgsolver/pcg_solver.h"
+
+enum SolveSystem {
+   SOLVE_PRESSURE,
+   SOLVE_VISCOSITY,
+   SOLVE_SYSTEM_COUNT
+};
+
+inline const char* solve_system_name(int system)
+{
+   static const char* names[SOLVE_SYSTEM_COUNT] = {
+      "pressure",
+      "viscosity"
+   };
+   return (system >= 0 && system < SOLVE_SYSTEM_COUNT) ? names[system] : "unknown";
+}
+
+struct SolveRecord
+{
+   long long sequence; // position among all solves recorded since the last clear
+   long long substep; // simulation substep the solve belongs to
+   SolveSystem system;
+   PCGSolveStats stats;
+};
+
+struct SolverTelemetry
+{
+   explicit SolverTelemetry(unsigned int capacity_=4096)
+      : capacity(capacity_), head(0), recorded(0)
+   {}
+
+   // changing the capacity discards the current records
+   void set_capacity(unsigned int capacity_)
+   {
+      capacity=capacity_;
+      clear();
+   }
+
+   void clear(void)
+   {
+      records.clear();
+      head=0;
+      recorded=0;
+   }
+
+   void record(long long substep, SolveSystem system, const PCGSolveStats &stats)
+   {
+      if(capacity==0) return;
+      SolveRecord *slot;
+      if(records.size()<capacity){
+         records.push_back(SolveRecord());
+         slot=&records.back();
+      }else{
+         slot=&records[head];
+         head=(head+1)%capacity;
+      }
+      slot->sequence=recorded++;
+      slot->substep=substep;
+      slot->system=system;
+      slot->stats=stats;
+   }
+
+   // records held, oldest first: (*this)[0] ... (*this)[size()-1]
+   unsigned int size(void) const { return (unsigned int)records.size(); }
+   const SolveRecord& operator[](unsigned int k) const { return records[(head+k)%records.size()]; }
+
+   // solves seen since the last clear, including those that have dropped out
+   long long total_recorded(void) const { return recorded; }
+
+   // One line per record, oldest first; the residual history (if any) is the
+   // last column, as a space-separated list.
+   void write_csv(std::ostream &output) const
+   {
+      output<<"sequence,substep,system,n,nonzeros,iterations,initial_residual,final_residual,"
+            <<"factor_s,iteration_s,converged,residual_history"<<std::endl;
+      for(unsigned int k=0; k<size(); ++k){
+         const SolveRecord &entry=(*this)[k];
+         const PCGSolveStats &stats=entry.stats;
+         output<<entry.sequence<<","<<entry.substep<<","<<solve_system_name(entry.system)<<","
+               <<stats.n<<","<<stats.nonzeros<<","<<stats.iterations<<","
+               <<stats.initial_residual<<","<<stats.final_residual<<","
+               <<stats.factor_seconds<<","<<stats.iteration_seconds<<","
+               <<(stats.converged ? 1 : 0)<<",";
+         for(unsigned int i=0; i<stats.residual_history.size(); ++i)
+            output<<(i ? " " : "")<<stats.residual_history[i];
+         output<<std::endl;
+      }
+   }
+
+private:
+
+   unsigned int capacity;
+   std::vector<SolveRecord> records;
+   unsigned int head; // oldest record once the buffer is full
+   long long recorded;
+};
+
+#endif
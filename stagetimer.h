@@ -0,0 +1,148 @@
+#ifndef STAGETIMER_H
+#define STAGETIMER_H
+
+// Low-overhead per-stage wall-clock accounting for the simulation loop.
+// A ScopedStageTimer adds the nanoseconds spent in its scope, plus one call,
+// to a StageTimers table. Define FLUIDSIM_NO_TIMING to compile the
+// FLUIDSIM_TIME_STAGE markers out entirely.
+//
+// Some stages are parts of another one (e.g. the assembly of a linear system
+// within apply_projection); they are reported under their parent stage and
+// left out of the total, so the top-level stages still add up to it.
+
+#include <chrono>
+#include <ostream>
+
+enum SimStage {
+   STAGE_ADVECT_PARTICLES,
+   STAGE_COMPUTE_PHI,
+   STAGE_ADVECT,
+   STAGE_ADD_FORCE,
+   STAGE_APPLY_VISCOSITY,
+   STAGE_APPLY_PROJECTION,
+   STAGE_EXTRAPOLATE,
+   STAGE_CONSTRAIN_VELOCITY,
+   STAGE_VISCOSITY_STATES,
+   STAGE_ASSEMBLE_VISCOSITY,
+   STAGE_ASSEMBLE_PRESSURE,
+   STAGE_COUNT
+};
+
+inline const char* stage_name(int stage)
+{
+   static const char* names[STAGE_COUNT] = {
+      "advect_particles",
+      "compute_phi",
+      "advect",
+      "add_force",
+      "apply_viscosity",
+      "apply_projection",
+      "extrapolate",
+      "constrain_velocity",
+      "viscosity_states",
+      "assemble_viscosity",
+      "assemble_pressure"
+   };
+   return (stage >= 0 && stage < STAGE_COUNT) ? names[stage] : "unknown";
+}
+
+// the stage a stage is part of, or -1 for top-level stages
+inline int stage_parent(int stage)
+{
+   switch(stage){
+      case STAGE_VISCOSITY_STATES:
+      case STAGE_ASSEMBLE_VISCOSITY: return STAGE_APPLY_VISCOSITY;
+      case STAGE_ASSEMBLE_PRESSURE: return STAGE_APPLY_PROJECTION;
+      default: return -1;
+   }
+}
+
+struct StageStats
+{
+   long long nanoseconds;
+   long long calls;
+
+   StageStats(void) : nanoseconds(0), calls(0) {}
+   double seconds(void) const { return 1e-9*nanoseconds; }
+};
+
+struct StageTimers
+{
+   StageStats stage[STAGE_COUNT];
+
+   void reset(void)
+   {
+      for(int s=0; s<STAGE_COUNT; ++s) stage[s]=StageStats();
+   }
+
+   void add(int s, long long nanoseconds)
+   {
+      stage[s].nanoseconds+=nanoseconds;
+      ++stage[s].calls;
+   }
+
+   const StageStats& operator[](int s) const { return stage[s]; }
+
+   long long total_nanoseconds(void) const
+   {
+      long long total=0;
+      for(int s=0; s<STAGE_COUNT; ++s)
+         if(stage_parent(s)<0) total+=stage[s].nanoseconds;
+      return total;
+   }
+
+   void write_csv(std::ostream &output) const
+   {
+      output<<"stage,calls,total_ns,mean_ns,fraction,parent"<<std::endl;
+      long long total=total_nanoseconds();
+      for(int s=0; s<STAGE_COUNT; ++s){
+         output<<stage_name(s)<<","<<stage[s].calls<<","<<stage[s].nanoseconds<<","
+               <<(stage[s].calls ? stage[s].nanoseconds/stage[s].calls : 0)<<","
+               <<(total ? (double)stage[s].nanoseconds/total : 0.0)<<","
+               <<(stage_parent(s)>=0 ? stage_name(stage_parent(s)) : "")<<std::endl;
+      }
+   }
+
+   void write_json(std::ostream &output) const
+   {
+      output<<"{\n  \"stages\": [";
+      for(int s=0; s<STAGE_COUNT; ++s){
+         output<<(s ? ",\n" : "\n")<<"    {\"stage\": \""<<stage_name(s)<<"\", \"calls\": "<<stage[s].calls
+               <<", \"total_ns\": "<<stage[s].nanoseconds;
+         if(stage_parent(s)>=0) output<<", \"parent\": \""<<stage_name(stage_parent(s))<<"\"";
+         output<<"}";
+      }
+      output<<"\n  ],\n  \"total_ns\": "<<total_nanoseconds()<<"\n}"<<std::endl;
+   }
+};
+
+struct ScopedStageTimer
+{
+   StageTimers &timers;
+   int s;
+   std::chrono::steady_clock::time_point start;
+
+   ScopedStageTimer(StageTimers &timers_, int s_)
+      : timers(timers_), s(s_), start(std::chrono::steady_clock::now())
+   {}
+
+   ~ScopedStageTimer(void)
+   {
+      timers.add(s, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count());
+   }
+
+private:
+   ScopedStageTimer(const ScopedStageTimer&);
+   ScopedStageTimer& operator=(const ScopedStageTimer&);
+};
+
+#define FLUIDSIM_TIMER_CONCAT_(a,b) a##b
+#define FLUIDSIM_TIMER_CONCAT(a,b) FLUIDSIM_TIMER_CONCAT_(a,b)
+
+#ifdef FLUIDSIM_NO_TIMING
+#define FLUIDSIM_TIME_STAGE(timers, stage)
+#else
+#define FLUIDSIM_TIME_STAGE(timers, stage) ScopedStageTimer FLUIDSIM_TIMER_CONCAT(stage_timer_, __LINE__)(timers, stage)
+#endif
+
+#endif
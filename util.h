@@ -3,6 +3,7 @@
 
 #include <algorithm>
 #include <vector>
+#include <climits>
 #include <cmath>
 #include <iostream>
 
@@ -0,0 +1,107 @@
+#ifndef VISCOUSSTENCIL_H
+#define VISCOUSSTENCIL_H
+
+// The viscous stress stencil of the variational viscosity system, as tables.
+//
+// Each row of the system belongs to a u or a v face. The four sides of its
+// control volume carry stress fluxes: normal stress (uxx or vyy) through the
+// two sides centred on cells, and shear stress through the two sides centred on
+// nodes. The weight of a flux is scale*dt/dx^2 times the viscosity and the
+// liquid volume fraction sampled at its side. Each term then adds sign*weight
+// to one face of the row. That face is either the row's own face (the
+// diagonal), a face with an unknown (a coupling), or a SOLID face, whose
+// known velocity moves to the right-hand side.
+//
+// Offsets are relative to the row's face (i,j), in the index space of the grid
+// being sampled. The terms are listed in the order the original hand-written
+// assembly added them, and node viscosities average their four cells in its
+// order, so the assembled system is unchanged to the last bit.
+//
+// FluidSim::add_viscous_row is instantiated per stencil type and expands the
+// tables term by term at compile time, so every test on a table field folds
+// away and only the per-face FLUID/SOLID test is left. A variant stencil
+// (anisotropic viscosity, say) is another pair of tables and a stencil type.
+
+enum StencilFace {
+   STENCIL_U_FACE,
+   STENCIL_V_FACE
+};
+
+enum StencilSample {
+   STENCIL_CELL, //c_vol, at cell (i+si, j+sj)
+   STENCIL_NODE  //n_vol, at node (i+si, j+sj)
+};
+
+struct ViscousFlux
+{
+   float scale; //2 for normal stress, 1 for shear
+   StencilSample sample;
+   int si, sj; //where the volume fraction is sampled
+   int cells; //cells whose viscosity is averaged (1 or 4)
+   int ci[4], cj[4];
+};
+
+struct ViscousTerm
+{
+   int flux;
+   StencilFace face;
+   int di, dj;
+   float sign;
+};
+
+//u rows: uxx through the cells right and left of the face, uyy and vxy
+//through the nodes above and below it
+constexpr ViscousFlux U_ROW_FLUXES[4] = {
+   { 2, STENCIL_CELL, 0, 0, 1, {0}, {0} },
+   { 2, STENCIL_CELL, -1, 0, 1, {-1}, {0} },
+   { 1, STENCIL_NODE, 0, 1, 4, {-1, -1, 0, 0}, {1, 0, 1, 0} },
+   { 1, STENCIL_NODE, 0, 0, 4, {-1, -1, 0, 0}, {0, -1, 0, -1} }
+};
+
+constexpr ViscousTerm U_ROW_TERMS[12] = {
+   { 0, STENCIL_U_FACE, 0, 0, 1 }, { 0, STENCIL_U_FACE, 1, 0, -1 },   //u_x_right
+   { 1, STENCIL_U_FACE, 0, 0, 1 }, { 1, STENCIL_U_FACE, -1, 0, -1 },  //u_x_left
+   { 2, STENCIL_U_FACE, 0, 0, 1 }, { 2, STENCIL_U_FACE, 0, 1, -1 },   //u_y_top
+   { 3, STENCIL_U_FACE, 0, 0, 1 }, { 3, STENCIL_U_FACE, 0, -1, -1 },  //u_y_bottom
+   { 2, STENCIL_V_FACE, 0, 1, -1 }, { 2, STENCIL_V_FACE, -1, 1, 1 },  //v_x_top
+   { 3, STENCIL_V_FACE, 0, 0, 1 }, { 3, STENCIL_V_FACE, -1, 0, -1 }   //v_x_bottom
+};
+
+//v rows: vyy through the cells above and below the face, vxx and uyx
+//through the nodes right and left of it
+constexpr ViscousFlux V_ROW_FLUXES[4] = {
+   { 2, STENCIL_CELL, 0, 0, 1, {0}, {0} },
+   { 2, STENCIL_CELL, 0, -1, 1, {0}, {-1} },
+   { 1, STENCIL_NODE, 1, 0, 4, {0, 1, 0, 1}, {-1, -1, 0, 0} },
+   { 1, STENCIL_NODE, 0, 0, 4, {0, -1, 0, -1}, {-1, -1, 0, 0} }
+};
+
+constexpr ViscousTerm V_ROW_TERMS[12] = {
+   { 0, STENCIL_V_FACE, 0, 0, 1 }, { 0, STENCIL_V_FACE, 0, 1, -1 },   //v_y_top
+   { 1, STENCIL_V_FACE, 0, 0, 1 }, { 1, STENCIL_V_FACE, 0, -1, -1 },  //v_y_bottom
+   { 2, STENCIL_V_FACE, 0, 0, 1 }, { 2, STENCIL_V_FACE, 1, 0, -1 },   //v_x_right
+   { 3, STENCIL_V_FACE, 0, 0, 1 }, { 3, STENCIL_V_FACE, -1, 0, -1 },  //v_x_left
+   { 2, STENCIL_U_FACE, 1, 0, -1 }, { 2, STENCIL_U_FACE, 1, -1, 1 },  //u_y_right
+   { 3, STENCIL_U_FACE, 0, 0, 1 }, { 3, STENCIL_U_FACE, 0, -1, -1 }   //u_y_left
+};
+
+//Stencil types: the row's face and table access usable in constant expressions
+struct URowStencil
+{
+   static const StencilFace FACE = STENCIL_U_FACE;
+   static const int FLUXES = 4;
+   static const int TERMS = 12;
+   static constexpr ViscousFlux flux(int f) { return U_ROW_FLUXES[f]; }
+   static constexpr ViscousTerm term(int t) { return U_ROW_TERMS[t]; }
+};
+
+struct VRowStencil
+{
+   static const StencilFace FACE = STENCIL_V_FACE;
+   static const int FLUXES = 4;
+   static const int TERMS = 12;
+   static constexpr ViscousFlux flux(int f) { return V_ROW_FLUXES[f]; }
+   static constexpr ViscousTerm term(int t) { return V_ROW_TERMS[t]; }
+};
+
+#endif